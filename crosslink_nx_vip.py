@@ -25,6 +25,7 @@ from litex.build.io import CRG
 from litex.build.generic_platform import *
 
 from litex.soc.interconnect import wishbone
+from litex.soc.integration.common import get_mem_data
 
 from litex.soc.cores.clock import *
 from litex.soc.integration.soc_core import *
@@ -36,9 +37,13 @@ from litex.soc.cores.freqmeter import FreqMeter
 from litex.soc.cores.gpio import GPIOIn, GPIOOut
 
 from litex.build.lattice.oxide import oxide_args, oxide_argdict
+from litex.build.sim.config import SimConfig
 
-from dphy_wrapper import DPHY_CSIRX_CIL
+from dphy_wrapper import DPHY_CSIRX_CIL, LMMIMaster
 from mipi_csi import *
+from hyperram_cache import HyperRAMCache
+import pixel_cfu
+import sim
 
 kB = 1024
 mB = 1024*kB
@@ -79,9 +84,14 @@ class BaseSoC(SoCCore):
         "main_ram":         0x50000000,
         "csr":              0xf0000000,
     }
-    def __init__(self, sys_clk_freq=int(75e6), hyperram="none", toolchain="radiant", **kwargs):
-        platform = lattice_crosslink_nx_vip.Platform(toolchain=toolchain)
-        platform.add_platform_command("ldc_set_sysconfig {{MASTER_SPI_PORT=SERIAL}}")
+    def __init__(self, sys_clk_freq=int(75e6), hyperram="none", hyperram_cache=4096, toolchain="radiant",
+                 sim_image=None, sim_image_width=1920, sim_image_height=1080, sim_firmware=None, **kwargs):
+        self.is_sim = toolchain == "verilator"
+        if self.is_sim:
+            platform = sim.Platform()
+        else:
+            platform = lattice_crosslink_nx_vip.Platform(toolchain=toolchain)
+            platform.add_platform_command("ldc_set_sysconfig {{MASTER_SPI_PORT=SERIAL}}")
 
         _lcd_pmod_ios = [
             ("lcd_spi", 0,
@@ -97,8 +107,13 @@ class BaseSoC(SoCCore):
                 Misc("SLEWRATE=FAST"),
                 IOStandard("LVCMOS33"),
              ),
+            ("snap_trigger", 0,
+                Pins("PMOD0:6"),
+                IOStandard("LVCMOS33"),
+             ),
         ]
-        platform.add_extension(_lcd_pmod_ios)
+        if not self.is_sim:
+            platform.add_extension(_lcd_pmod_ios)
 
         # Disable Integrated SRAM since we want to instantiate LRAM specifically for it
         kwargs["integrated_sram_size"] = 0
@@ -110,19 +125,37 @@ class BaseSoC(SoCCore):
             **kwargs)
 
         # CRG --------------------------------------------------------------------------------------
-        refclk = platform.request("clk27_0")
-        self.submodules.crg = _CRG(platform, refclk, sys_clk_freq)
+        if self.is_sim:
+            self.submodules.crg = CRG(platform.request("sys_clk"))
+        else:
+            refclk = platform.request("clk27_0")
+            self.submodules.crg = _CRG(platform, refclk, sys_clk_freq)
 
         # 128KB LRAM (used as SRAM) ------------------------------------------------------------
         size = 128*kB
-        self.submodules.spram = NXLRAM(32, size)
+        if self.is_sim:
+            self.submodules.spram = wishbone.SRAM(size)
+        else:
+            self.submodules.spram = NXLRAM(32, size)
         self.bus.add_slave("sram", slave=self.spram.bus, region=SoCRegion(origin=self.mem_map["sram"],
                 size=size))
         # Use HyperRAM generic PHY as main ram -----------------------------------------------------
         size = 8*1024*kB
-        hr_pads = platform.request("hyperram", 0)
-        self.submodules.hyperram = HyperRAM(hr_pads)
-        self.bus.add_slave("main_ram", slave=self.hyperram.bus, region=SoCRegion(origin=self.mem_map["main_ram"],
+        if self.is_sim:
+            # firmware is preloaded and booted directly by the BIOS
+            firmware = get_mem_data(sim_firmware, endianness="little") if sim_firmware is not None else []
+            self.submodules.hyperram = sim.SimHyperRAM(size, init=firmware)
+            if sim_firmware is not None:
+                self.add_constant("ROM_BOOT_ADDRESS", self.mem_map["main_ram"])
+        else:
+            hr_pads = platform.request("hyperram", 0)
+            self.submodules.hyperram = HyperRAM(hr_pads)
+        main_ram_bus = self.hyperram.bus
+        if hyperram_cache:
+            self.submodules.hr_cache = HyperRAMCache(self.hyperram.bus, size, cache_size=hyperram_cache)
+            self.add_csr("hr_cache")
+            main_ram_bus = self.hr_cache.bus
+        self.bus.add_slave("main_ram", slave=main_ram_bus, region=SoCRegion(origin=self.mem_map["main_ram"],
                 size=size, mode="rwx"))
         # Leds -------------------------------------------------------------------------------------
         self.submodules.leds = LedChaser(
@@ -130,10 +163,14 @@ class BaseSoC(SoCCore):
             sys_clk_freq = sys_clk_freq)
         self.add_csr("leds")
 
-        cam_mclk = platform.request("camera_mclk", 0)
-        self.comb += cam_mclk.eq(refclk)
+        if not self.is_sim:
+            cam_mclk = platform.request("camera_mclk", 0)
+            self.comb += cam_mclk.eq(refclk)
 
-        self.submodules.i2c = I2CMaster(platform.request("i2c", 0))
+        if self.is_sim:
+            self.submodules.i2c = sim.SimI2CSensor(addr=0x1a)
+        else:
+            self.submodules.i2c = I2CMaster(platform.request("i2c", 0))
         self.add_csr("i2c")
 
         self.submodules.lcd_spi = SPIMaster(platform.request("lcd_spi", 0),
@@ -143,38 +180,43 @@ class BaseSoC(SoCCore):
         self.submodules.lcd_gpio = GPIOOut(platform.request("lcd_gpio", 0))
         self.add_csr("lcd_gpio")
 
-        self.submodules.dphy = DPHY_CSIRX_CIL(
-            pads        = platform.request("camera", 0),
-            num_lanes   = 4,
-            clk_mode    = "ENABLED",
-            deskew      = "DISABLED",
-            gearing     = 8,
-            loc         = "TDPHY_CORE2",
-        )
+        if self.is_sim:
+            pixels = sim.load_raw_image(sim_image, sim_image_width, sim_image_height)
+            self.submodules.dphy = sim.SimDPHY(
+                clk         = platform.request("mipi_clk"),
+                words       = sim.image_to_lane_words(pixels, sim_image_width, sim_image_height),
+                width       = sim_image_width,
+                height      = sim_image_height,
+            )
+            self.comb += self.dphy.enable.eq(self.i2c.streaming)
+            platform.add_source(os.path.join(os.path.dirname(os.path.abspath(__file__)), "sim_frame_report.v"))
+        else:
+            self.submodules.dphy = DPHY_CSIRX_CIL(
+                pads        = platform.request("camera", 0),
+                num_lanes   = 4,
+                clk_mode    = "ENABLED",
+                deskew      = "DISABLED",
+                gearing     = 8,
+                loc         = "TDPHY_CORE2",
+            )
+
+        self.submodules.dphy_lmmi = LMMIMaster(self.dphy.lmmi)
+        self.add_csr("dphy_lmmi")
 
         self.comb += [
             self.dphy.sync_clk.eq(ClockSignal()),
             self.dphy.sync_rst.eq(ResetSignal()),
-            self.dphy.pd_dphy.eq(0),
-            self.dphy.hs_rx_en.eq(1),
         ]
 
         self.submodules.clk_byte_freq = FreqMeter(period=sys_clk_freq, clk=self.dphy.clk_byte)
         self.add_csr("clk_byte_freq")
-        self.submodules.hs_rx_data = GPIOIn(pads=self.dphy.hs_rx_data)
-        self.add_csr("hs_rx_data")
-        self.submodules.hs_rx_sync = GPIOIn(pads=self.dphy.hs_rx_sync)
-        self.add_csr("hs_rx_sync")
 
         self.clock_domains.cd_mipi = ClockDomain()
         self.comb += self.cd_mipi.clk.eq(self.dphy.clk_byte)
-        dphy_header = Signal(32)
-        for i in range(0, 4):
-            prev_sync = Signal()
-            self.sync.mipi += prev_sync.eq(self.dphy.hs_rx_sync[i])
-            self.sync.mipi += If(prev_sync, dphy_header[(8*i):(8*(i+1))].eq(self.dphy.hs_rx_data[(8*i):(8*(i+1))]))
-        self.submodules.dphy_header = GPIOIn(pads=dphy_header)
-        self.add_csr("dphy_header")
+
+        # raw per-lane samples ahead of the word aligner, for lane skew and sync problems
+        self.submodules.dphy_trace = DPHYTrace(self.dphy.hs_rx_data, self.dphy.hs_rx_sync, depth=1024)
+        self.add_csr("dphy_trace")
 
         wa = WordAligner(lane_width=8, num_lanes=4, depth=3)
 #        swapped_data = Cat(self.dphy.hs_rx_data[24:32], self.dphy.hs_rx_data[8:16], self.dphy.hs_rx_data[16:24], self.dphy.hs_rx_data[0:8])
@@ -184,21 +226,91 @@ class BaseSoC(SoCCore):
         ]
         self.submodules.wa = wa
 
-        packet_cap = PacketCapture(data=wa.data_out, data_sync=wa.sync_out, depth=1024)
+        # CSI-2 packets are moved into the sys domain here; all consumers hang off csi.source
+        self.submodules.csi = CSI2Stream(data=wa.data_out, data_sync=wa.sync_out, fifo_depth=64)
+        self.add_csr("csi")
+        csi_sinks = []
+
+        packet_cap = PacketCapture(depth=1024)
         self.submodules.packet_cap = packet_cap
+        csi_sinks.append(packet_cap.sink)
         packet_io = wishbone.SRAM(self.packet_cap.mem, read_only=True)
         self.submodules.packet_io = packet_io
         self.bus.add_slave("packet_io", slave=packet_io.bus, region=SoCRegion(origin=0xb0000000, size=0x4000, mode="rw", cached=False))
 
-        image_cap = ImageCapture(data=wa.data_out, data_sync=wa.sync_out, subsample_x=5, subsample_y=9, out_width=96, out_height=108)
-        self.submodules.image_cap = image_cap
-        image_io = wishbone.SRAM(self.image_cap.mem, read_only=True)
+        # preview pyramid: the console thumbnail and the LCD level both cover the full 960x540 quads with the
+        # same step on both axes, the LCD one letterboxed on the 128x128 panel. Both are single buffered to fit
+        # the 84 EBR of the LIFCL-40, so a hold waits for the end of the frame being written. Then the temporal
+        # accumulator and the tile change map
+        pyramid = PyramidCapture(levels=[
+            ("thumb", PyramidLevel(max_width=96,  max_height=54,  step_x=10, step_y=10, double_buffer=False)),
+            ("lcd",   PyramidLevel(max_width=120, max_height=68,  step_x=8,  step_y=8,  double_buffer=False)),
+            # low light: 48x27 quads summed or averaged over frames
+            ("accum", FrameAccumulator(max_width=48, max_height=27, step_x=20, step_y=20)),
+            # 12x7 tiles of 80x80 quads, each tile 4x4 box sums of 20x20 quads
+            ("changes", ChangeMap(max_width=48, max_height=27, step_x=20, step_y=20, tile=4)),
+        ])
+        self.submodules.pyramid = pyramid
+        self.add_csr("pyramid")
+        self.irq.add("pyramid", use_loc_if_exists=True)
+        csi_sinks.append(pyramid.sink)
+        if self.is_sim:
+            # frame rate as consumed: frames completed by the thumbnail level
+            self.submodules.frame_report = sim.SimFrameReport(pyramid.thumb.frame.status, self.dphy.frame_done,
+                self.csi.overflows.status)
+        image_io = wishbone.SRAM(self.pyramid.thumb.mem, read_only=True)
         self.submodules.image_io = image_io
-        self.bus.add_slave("image_io", slave=image_io.bus, region=SoCRegion(origin=0xb0010000, size=0x10000, mode="rw", cached=False))
-
-        self.submodules.line_count = GPIOIn(pads=image_cap.last_line_count)
+        # a held level doesn't change, so it can be read through the data cache;
+        # the uncached alias is kept for comparison
+        image_io_cached = wishbone.Interface()
+        image_io_uncached = wishbone.Interface()
+        self.submodules.image_io_arbiter = wishbone.Arbiter([image_io_cached, image_io_uncached], image_io.bus)
+        self.bus.add_slave("image_io", slave=image_io_cached, region=SoCRegion(origin=0x60000000, size=0x10000, mode="rw", cached=True))
+        self.bus.add_slave("image_io_uncached", slave=image_io_uncached, region=SoCRegion(origin=0xb0010000, size=0x10000, mode="rw", cached=False))
+        lcd_io = wishbone.SRAM(self.pyramid.lcd.mem, read_only=True)
+        self.submodules.lcd_io = lcd_io
+        self.bus.add_slave("lcd_io", slave=lcd_io.bus, region=SoCRegion(origin=0x60020000, size=0x10000, mode="rw", cached=True))
+
+        self.submodules.line_count = GPIOIn(pads=pyramid.last_line_count)
         self.add_csr("line_count")
 
+        roi_cap = ROICapture(width=256, height=64)
+        self.submodules.roi_cap = roi_cap
+        self.add_csr("roi_cap")
+        csi_sinks.append(roi_cap.sink)
+        roi_io = wishbone.SRAM(self.roi_cap.mem, read_only=True)
+        self.submodules.roi_io = roi_io
+        # only written between arm and done, so safe to cache once done
+        self.bus.add_slave("roi_io", slave=roi_io.bus, region=SoCRegion(origin=0x60010000, size=0x10000, mode="rw", cached=True))
+
+        self.submodules.pattern_check = PatternChecker()
+        self.add_csr("pattern_check")
+        csi_sinks.append(self.pattern_check.sink)
+
+        # lossless line compression into main_ram; the firmware picks the buffer addresses
+        compressor_bus = wishbone.Interface()
+        self.submodules.compressor = LineCompressor(compressor_bus)
+        self.add_csr("compressor")
+        self.bus.add_master(name="compressor", master=compressor_bus)
+        csi_sinks.append(self.compressor.sink)
+
+        # snapshot mode: D-PHY powered down until a snap command or a rising edge on the trigger pin
+        self.submodules.snapshot = SnapshotControl(overflows=self.csi.overflows.status)
+        self.add_csr("snapshot")
+        self.irq.add("snapshot", use_loc_if_exists=True)
+        csi_sinks.append(self.snapshot.sink)
+        self.comb += [
+            self.dphy.pd_dphy.eq(self.snapshot.pd_dphy),
+            self.dphy.hs_rx_en.eq(self.snapshot.hs_rx_en),
+        ]
+        if not self.is_sim:
+            self.comb += self.snapshot.trigger.eq(platform.request("snap_trigger", 0))
+
+        self.submodules.csi_broadcast = StreamBroadcast(csi_packet_description(), len(csi_sinks))
+        self.comb += self.csi.source.connect(self.csi_broadcast.sink)
+        for source, sink in zip(self.csi_broadcast.sources, csi_sinks):
+            self.comb += source.connect(sink)
+
 # Build --------------------------------------------------------------------------------------------
 
 def main():
@@ -208,20 +320,60 @@ def main():
     parser.add_argument("--toolchain",     default="radiant",   help="FPGA toolchain: radiant (default) or prjoxide")
     parser.add_argument("--sys-clk-freq",  default=75e6,        help="System clock frequency (default: 75MHz)")
     parser.add_argument("--with-hyperram", default="none",      help="Enable use of HyperRAM chip: none (default), 0 or 1")
+    parser.add_argument("--hyperram-cache", default=4096,       help="Bytes of read cache in front of HyperRAM, 0 for none (default: 4096)")
     parser.add_argument("--prog-target",   default="direct",    help="Programming Target: direct (default) or flash")
+    parser.add_argument("--sim",           action="store_true", help="Build and run a Verilator simulation of the SoC")
+    parser.add_argument("--sim-image",     default=None,        help="Raw Bayer image replayed by the simulated sensor (default: colour bars)")
+    parser.add_argument("--sim-image-width",  default=1920,     help="Simulated sensor image width (default: 1920)")
+    parser.add_argument("--sim-image-height", default=1080,     help="Simulated sensor image height (default: 1080)")
+    parser.add_argument("--sim-firmware",  default=None,        help="Firmware binary to preload into simulated main_ram and boot")
+    parser.add_argument("--pixel-cfu",     action="store_true", help="Use the full+cfu CPU with the pixel custom instructions")
     builder_args(parser)
     oxide_args(parser)
     args = parser.parse_args()
 
+    soc_kwargs = {}
+    if args.sim:
+        soc_kwargs.update(
+            uart_name        = "sim",
+            sim_image        = args.sim_image,
+            sim_image_width  = int(args.sim_image_width),
+            sim_image_height = int(args.sim_image_height),
+            sim_firmware     = args.sim_firmware,
+        )
+    cpu_variant = "lite"
+    if args.pixel_cfu:
+        # the prebuilt lite core has no CFU port, so this costs the caches and multiplier of the full core too
+        cpu_variant = "full+cfu"
+        output_dir = args.output_dir or os.path.join("build", "sim" if args.sim else "lattice_crosslink_nx_vip")
+        soc_kwargs["cpu_cfu"] = pixel_cfu.generate(os.path.join(output_dir, "gateware", "pixel_cfu.v"))
     soc = BaseSoC(
         sys_clk_freq = int(float(args.sys_clk_freq)),
         hyperram     = args.with_hyperram,
-        toolchain    = args.toolchain,
+        hyperram_cache = int(args.hyperram_cache),
+        toolchain    = "verilator" if args.sim else args.toolchain,
         cpu_type     = "vexriscv",
-        cpu_variant  = "lite",
+        cpu_variant  = cpu_variant,
         integrated_rom_size = 32768,
+        timer_uptime = True, # cycle counter for firmware profiling
+        **soc_kwargs
     )
-    builder = Builder(soc, **builder_argdict(args))
+    if args.pixel_cfu:
+        soc.add_constant("PIXEL_CFU")
+    builder_kwargs = builder_argdict(args)
+    if args.sim and builder_kwargs.get("output_dir") is None:
+        builder_kwargs["output_dir"] = os.path.join("build", "sim")
+    builder = Builder(soc, **builder_kwargs)
+    if args.sim:
+        sim_config = SimConfig()
+        sim_config.add_clocker("sys_clk", freq_hz=int(float(args.sys_clk_freq)))
+        # byte clock for a 1485Mbps 4-lane link, as configured by camera.c
+        sim_config.add_clocker("mipi_clk", freq_hz=int(46.4e6))
+        sim_config.add_module("serial2console", "serial")
+        builder.build(sim_config=sim_config, run=False)
+        if builder.compile_gateware:
+            sim.run_sim(builder.gateware_dir)
+        return
     builder_kargs = oxide_argdict(args) if args.toolchain == "oxide" else {}
     builder.build(**builder_kargs, run=args.build)
 
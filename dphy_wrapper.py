@@ -1,4 +1,89 @@
 from migen import *
+from litex.soc.interconnect.csr import *
+
+# Lattice Memory Mapped Interface, as used to configure the hard D-PHY at runtime
+lmmi_layout = [
+    ("request",      1),
+    ("wr_rdn",       1),
+    ("offset",       5),
+    ("wdata",        4),
+    ("rdata",        4),
+    ("rdata_valid",  1),
+    ("ready",        1),
+]
+
+# CSR-mapped LMMI master. Write offset/wdata/write to control with start set, then poll status.busy;
+# reads complete when the slave returns rdata_valid, which may come with ready already. status.error is set if
+# the slave doesn't respond in time
+class LMMIMaster(Module, AutoCSR):
+    def __init__(self, lmmi, timeout=1024):
+        self.control = CSRStorage(fields=[
+            CSRField("start",  size=1, offset=0, pulse=True),
+            CSRField("write",  size=1, offset=1),
+            CSRField("offset", size=5, offset=8),
+            CSRField("wdata",  size=4, offset=16),
+        ])
+        self.status = CSRStatus(fields=[
+            CSRField("busy",  size=1, offset=0),
+            CSRField("error", size=1, offset=1),
+            CSRField("rdata", size=4, offset=16),
+        ])
+
+        offset = Signal(5)
+        wdata = Signal(4)
+        write = Signal()
+        rdata = Signal(4)
+        error = Signal()
+        timer = Signal(max=timeout + 1)
+        self.comb += [
+            lmmi.offset.eq(offset),
+            lmmi.wdata.eq(wdata),
+            lmmi.wr_rdn.eq(write),
+            self.status.fields.rdata.eq(rdata),
+            self.status.fields.error.eq(error),
+        ]
+
+        self.submodules.fsm = fsm = FSM(reset_state="IDLE")
+        fsm.act("IDLE",
+            If(self.control.fields.start,
+                NextValue(offset, self.control.fields.offset),
+                NextValue(wdata, self.control.fields.wdata),
+                NextValue(write, self.control.fields.write),
+                NextValue(error, 0),
+                NextValue(timer, timeout),
+                NextState("REQUEST")
+            )
+        )
+        fsm.act("REQUEST",
+            self.status.fields.busy.eq(1),
+            lmmi.request.eq(1),
+            NextValue(timer, timer - 1),
+            If(lmmi.ready,
+                NextValue(timer, timeout),
+                If(write,
+                    NextState("IDLE")
+                ).Elif(lmmi.rdata_valid,
+                    NextValue(rdata, lmmi.rdata),
+                    NextState("IDLE")
+                ).Else(
+                    NextState("READ")
+                )
+            ).Elif(timer == 0,
+                NextValue(error, 1),
+                NextState("IDLE")
+            )
+        )
+        fsm.act("READ",
+            self.status.fields.busy.eq(1),
+            NextValue(timer, timer - 1),
+            If(lmmi.rdata_valid,
+                NextValue(rdata, lmmi.rdata),
+                NextState("IDLE")
+            ).Elif(timer == 0,
+                NextValue(error, 1),
+                NextState("IDLE")
+            )
+        )
 
 # MIPI DPHY core; configured as MIPI CSI-2 receiver with control and interface logic
 class DPHY_CSIRX_CIL(Module):
@@ -7,7 +92,8 @@ class DPHY_CSIRX_CIL(Module):
         self.sync_clk = Signal()
         self.sync_rst = Signal()
         self.pd_dphy = Signal()
-        # TODO: LMMI (should create a LiteX peripheral)
+        # LMMI runs on sync_clk; drive it with LMMIMaster
+        self.lmmi = Record(lmmi_layout)
         self.hs_rx_en = Signal()
         self.hs_rx_data = Signal(data_width)
         self.hs_rx_sync = Signal(num_lanes)
@@ -65,7 +151,15 @@ class DPHY_CSIRX_CIL(Module):
             p_U_PRG_HS_ZERO="0b000000",
             p_U_PRG_RXHS_SETTLE="0b000011",
             p_UC_PRG_RXHS_SETTLE="0b000111",
+            i_LMMICLK=self.sync_clk,
             i_LMMIRESET_N=1,
+            i_LMMIREQUEST=self.lmmi.request,
+            i_LMMIWRRD_N=self.lmmi.wr_rdn,
+            i_LMMIOFFSET=self.lmmi.offset,
+            i_LMMIWDATA=self.lmmi.wdata,
+            o_LMMIRDATA=self.lmmi.rdata,
+            o_LMMIRDATAVALID=self.lmmi.rdata_valid,
+            o_LMMIREADY=self.lmmi.ready,
             i_BITCKEXT=1,
             i_CLKREF=1,
             i_PDDPHY=self.pd_dphy,
@@ -91,7 +185,6 @@ class DPHY_CSIRX_CIL(Module):
             o_U2RXSHS=int_sync[2],
             o_U3RXSHS=int_sync[3],
             o_URWDCKHS=self.clk_byte,
-            o_LMMIREADY=self.ready,
         )
 
         if pads is not None:
@@ -116,8 +209,10 @@ class DPHY_CSIRX_CIL(Module):
             'U1TXTGE3', 'U2TXTGE0', 'U2TXTGE1', 'U2TXTGE2', 'U2TXTGE3', 'U3TXTGE0', 'U3TXTGE1', 'U3TXTGE2',
             'U3TXTGE3', 'UCTXUPSX', 'UTXUPSEX', 'U1TXUPSX', 'U2TXUPSX', 'U3TXUPSX', 'UTXSKD0N', 'U1TXSK',
             'U2TXSKC', 'U3TXSKC', 'UTXRD0EN', 'U1TXREQ', 'U2TXREQ', 'U3TXREQ', 'UTXVDE', 'U1TXVDE', 'U2TXVDE',
-            'U3TXVD3', 'LTSTEN', 'LTSTLANE', 'LMMICLK', 
+            'U3TXVD3', 'LTSTEN', 'LTSTLANE',
         ]
+        self.comb += self.ready.eq(self.lmmi.ready)
+
         for p in const0_ports:
             conns["i_{}".format(p)] = 0
         self.specials.dphy = Instance("DPHY", **conns)
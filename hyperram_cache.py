@@ -0,0 +1,245 @@
+# Read cache between the SoC bus and the HyperRAM controller, which only does single word accesses with
+# the full HyperBus command latency each time.
+#
+# Direct mapped, with lines filled critical word first: the requested word is returned as soon as it arrives
+# and the rest of the line is read before the next access is served. Writes go straight through and update
+# the cached copy on a hit. After a miss the following line is prefetched whenever the bus is idle; a new
+# access pauses the prefetch between words and it resumes afterwards; a flush or clearing enable drops it.
+# All masters reach main_ram through here, so the cache stays coherent with what the line compressor writes.
+
+from migen import *
+from litex.soc.interconnect import wishbone
+from litex.soc.interconnect.csr import *
+
+class HyperRAMCache(Module, AutoCSR):
+    def __init__(self, master, size, cache_size=4096, line_size=32):
+        # master: bus of the HyperRAM controller, size: bytes of main_ram behind it
+        self.bus = slave = wishbone.Interface()
+        self.control = CSRStorage(fields=[
+            CSRField("enable",   size=1, offset=0, reset=1, description="Serve reads from the cache; while clear every access goes to HyperRAM and the cache is emptied"),
+            CSRField("prefetch", size=1, offset=1, reset=1, description="Fetch the next line after a miss"),
+            CSRField("flush",    size=1, offset=2, pulse=True, description="Invalidate all lines"),
+            CSRField("clear",    size=1, offset=3, pulse=True, description="Zero the counters"),
+        ])
+        self.hits = CSRStatus(32, description="Reads served from the cache")
+        self.misses = CSRStatus(32, description="Reads that had to fill a line")
+        self.prefetches = CSRStatus(32, description="Lines completely prefetched")
+        self.prefetch_hits = CSRStatus(32, description="Prefetched lines that were then read")
+
+        line_words = line_size // 4
+        nlines = cache_size // line_size
+        offset_bits = log2_int(line_words)
+        index_bits = log2_int(nlines)
+        tag_bits = log2_int(size // 4) - offset_bits - index_bits
+
+        data = Memory(32, nlines*line_words)
+        tags = Memory(tag_bits, nlines)
+        data_rd = data.get_port()
+        data_wr = data.get_port(write_capable=True, we_granularity=8)
+        tags_rd = tags.get_port()
+        tags_wr = tags.get_port(write_capable=True)
+        self.specials += data, tags, data_rd, data_wr, tags_rd, tags_wr
+
+        valid = Array(Signal() for _ in range(nlines))
+        prefetched = Array(Signal() for _ in range(nlines))
+
+        enable = self.control.fields.enable
+        request = Signal()
+        slave_offset = slave.adr[:offset_bits]
+        slave_index = slave.adr[offset_bits:offset_bits+index_bits]
+        slave_tag = slave.adr[offset_bits+index_bits:offset_bits+index_bits+tag_bits]
+        hit = Signal()
+        write_hit = Signal()
+
+        # line being filled on a miss
+        line_index = Signal(index_bits)
+        line_tag = Signal(tag_bits)
+        line_count = Signal(offset_bits)
+        line_left = Signal(max=line_words+1)
+        next_line = Signal(index_bits+tag_bits)
+
+        # line being prefetched
+        pf_pending = Signal()
+        pf_index = Signal(index_bits)
+        pf_tag = Signal(tag_bits)
+        pf_count = Signal(offset_bits)
+        pf_match = Signal()
+        pf_start = Signal()
+        pf_stop = Signal()
+
+        valid_index = Signal(index_bits)
+        valid_set = Signal()
+        valid_clr = Signal()
+        count_hit = Signal()
+        count_miss = Signal()
+        count_prefetch = Signal()
+        count_prefetch_hit = Signal()
+
+        self.comb += [
+            request.eq(slave.cyc & slave.stb),
+            data_rd.adr.eq(Cat(slave_offset, slave_index)),
+            tags_rd.adr.eq(Mux(request, slave_index, pf_index)),
+            hit.eq(valid[slave_index] & (tags_rd.dat_r == slave_tag)),
+            next_line.eq(Cat(line_index, line_tag) + 1),
+            pf_match.eq(pf_pending & (slave_index == pf_index) & (slave_tag == pf_tag)),
+            master.dat_w.eq(slave.dat_w),
+        ]
+
+        self.submodules.fsm = fsm = FSM(reset_state="IDLE")
+        fsm.act("IDLE",
+            If(request,
+                If(enable,
+                    NextState("LOOKUP")
+                ).Else(
+                    NextState("BYPASS")
+                )
+            ).Elif(pf_pending & enable & self.control.fields.prefetch,
+                NextState("PREFETCH_CHECK")
+            )
+        )
+        fsm.act("BYPASS",
+            master.cyc.eq(1),
+            master.stb.eq(1),
+            master.sel.eq(slave.sel),
+            master.we.eq(slave.we),
+            master.adr.eq(slave.adr),
+            slave.dat_r.eq(master.dat_r),
+            slave.ack.eq(master.ack),
+            If(master.ack,
+                If(slave.we & pf_match, NextValue(pf_count, 0)),
+                NextState("IDLE")
+            )
+        )
+        fsm.act("LOOKUP",
+            If(slave.we,
+                NextValue(write_hit, hit),
+                NextState("WRITE")
+            ).Elif(hit,
+                slave.dat_r.eq(data_rd.dat_r),
+                slave.ack.eq(1),
+                count_hit.eq(1),
+                count_prefetch_hit.eq(prefetched[slave_index]),
+                NextValue(prefetched[slave_index], 0),
+                NextState("IDLE")
+            ).Else(
+                count_miss.eq(1),
+                valid_index.eq(slave_index),
+                valid_clr.eq(1),
+                NextValue(prefetched[slave_index], 0),
+                NextValue(line_index, slave_index),
+                NextValue(line_tag, slave_tag),
+                NextValue(line_count, slave_offset),
+                NextValue(line_left, line_words),
+                pf_stop.eq(1),
+                NextState("FILL")
+            )
+        )
+        fsm.act("WRITE",
+            master.cyc.eq(1),
+            master.stb.eq(1),
+            master.sel.eq(slave.sel),
+            master.we.eq(1),
+            master.adr.eq(slave.adr),
+            slave.ack.eq(master.ack),
+            data_wr.adr.eq(Cat(slave_offset, slave_index)),
+            data_wr.dat_w.eq(slave.dat_w),
+            If(master.ack,
+                If(write_hit, data_wr.we.eq(slave.sel)),
+                # words already prefetched from this line may now be stale
+                If(pf_match, NextValue(pf_count, 0)),
+                NextState("IDLE")
+            )
+        )
+        fsm.act("FILL",
+            master.cyc.eq(1),
+            master.stb.eq(1),
+            master.sel.eq(0xF),
+            master.adr.eq(Cat(line_count, line_index, line_tag)),
+            slave.dat_r.eq(master.dat_r),
+            slave.ack.eq(master.ack & (line_left == line_words)),
+            data_wr.adr.eq(Cat(line_count, line_index)),
+            data_wr.dat_w.eq(master.dat_r),
+            tags_wr.adr.eq(line_index),
+            tags_wr.dat_w.eq(line_tag),
+            If(master.ack,
+                data_wr.we.eq(0xF),
+                NextValue(line_count, line_count + 1),
+                NextValue(line_left, line_left - 1),
+                If(line_left == 1,
+                    tags_wr.we.eq(1),
+                    valid_index.eq(line_index),
+                    valid_set.eq(1),
+                    pf_start.eq(1),
+                    NextValue(pf_index, next_line[:index_bits]),
+                    NextValue(pf_tag, next_line[index_bits:]),
+                    NextValue(pf_count, 0),
+                    NextState("IDLE")
+                )
+            )
+        )
+        fsm.act("PREFETCH_CHECK",
+            If(~pf_pending | (valid[pf_index] & (tags_rd.dat_r == pf_tag)),
+                pf_stop.eq(1),
+                NextState("IDLE")
+            ).Elif(request,
+                NextState("IDLE")
+            ).Else(
+                valid_index.eq(pf_index),
+                valid_clr.eq(1),
+                NextState("PREFETCH")
+            )
+        )
+        fsm.act("PREFETCH",
+            master.cyc.eq(1),
+            master.stb.eq(1),
+            master.sel.eq(0xF),
+            master.adr.eq(Cat(pf_count, pf_index, pf_tag)),
+            data_wr.adr.eq(Cat(pf_count, pf_index)),
+            data_wr.dat_w.eq(master.dat_r),
+            tags_wr.adr.eq(pf_index),
+            tags_wr.dat_w.eq(pf_tag),
+            If(master.ack,
+                data_wr.we.eq(0xF),
+                NextValue(pf_count, pf_count + 1),
+                If(~pf_pending,
+                    # flushed meanwhile
+                    NextState("IDLE")
+                ).Elif(pf_count == line_words - 1,
+                    tags_wr.we.eq(1),
+                    valid_index.eq(pf_index),
+                    valid_set.eq(1),
+                    count_prefetch.eq(1),
+                    NextValue(prefetched[pf_index], 1),
+                    pf_stop.eq(1),
+                    NextState("IDLE")
+                ).Elif(request,
+                    NextState("IDLE")
+                )
+            )
+        )
+
+        self.sync += [
+            If(self.control.fields.flush | ~enable,
+                [v.eq(0) for v in valid]
+            ).Elif(valid_clr,
+                valid[valid_index].eq(0)
+            ).Elif(valid_set,
+                valid[valid_index].eq(1)
+            ),
+            If(self.control.fields.flush | ~enable | pf_stop,
+                pf_pending.eq(0)
+            ).Elif(pf_start,
+                pf_pending.eq(1)
+            ),
+            If(self.control.fields.clear,
+                self.hits.status.eq(0),
+                self.misses.status.eq(0),
+                self.prefetches.status.eq(0),
+                self.prefetch_hits.status.eq(0),
+            ).Else(
+                If(count_hit, self.hits.status.eq(self.hits.status + 1)),
+                If(count_miss, self.misses.status.eq(self.misses.status + 1)),
+                If(count_prefetch, self.prefetches.status.eq(self.prefetches.status + 1)),
+                If(count_prefetch_hit, self.prefetch_hits.status.eq(self.prefetch_hits.status + 1)),
+            )
+        ]
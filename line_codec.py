@@ -0,0 +1,217 @@
+#!/usr/bin/env python3
+# Host side reference for the LineCompressor in mipi_csi.py.
+#
+# Each line is coded on its own, starting on a word boundary at the byte offset given by the line table:
+#   header word: [15:0] RAW10 byte count, [19:16] k for even columns, [23:20] k for odd columns, [31:24] 0xA5
+#   then per pixel, LSB first, the Golomb-Rice code of the residual against the previous pixel of the same
+#   colour in the line (512 for the first): q = m >> k ones, a zero, then the low k bits of m. Residuals e
+#   are mapped to m = 2e (e >= 0) or -2e - 1. If q >= 16 the code is 16 ones followed by m as 11 raw bits.
+#   The line is padded with zeros to a word boundary.
+# A line that lost its tail before reaching the compressor ends with a zero word after the codes it has, and its
+# table entry has bit 31 set; the decoder fills such lines with zeros and leaves them out of --check.
+# k for a line is chosen from the previous line with the same Bayer row type: the smallest k with n << k >= A,
+# where A is the sum of m over the n pixels of that column parity. Both lines of the first row pair use k = 4.
+#
+# encode: run the reference encoder over a raw image and report the compression ratio
+# decode: decode the output of the firmware `compress dump` command back to a raw image
+
+import sys
+import argparse
+
+K_INIT = 4
+K_MAX = 10
+Q_ESCAPE = 16
+HEADER_SYNC = 0xA5
+TABLE_BAD = 1 << 31
+
+def load_raw(filename, width, height):
+    # 16-bit little-endian samples (low 10 bits used) or CSI-2 packed RAW10, told apart by file size
+    with open(filename, "rb") as f:
+        data = f.read()
+    n = width * height
+    if len(data) == 2 * n:
+        return [(data[2*i] | (data[2*i+1] << 8)) & 0x3FF for i in range(n)]
+    elif len(data) == (n * 5) // 4:
+        pixels = []
+        for i in range(0, len(data), 5):
+            for j in range(4):
+                pixels.append((data[i+j] << 2) | ((data[i+4] >> (2*j)) & 0x3))
+        return pixels
+    raise ValueError("{}: size {} doesn't match a {}x{} raw image".format(filename, len(data), width, height))
+
+def save_raw(filename, pixels):
+    with open(filename, "wb") as f:
+        f.write(b"".join(p.to_bytes(2, "little") for p in pixels))
+
+class BitWriter:
+    def __init__(self):
+        self.words = []
+        self.acc = 0
+        self.level = 0
+
+    def put(self, value, length):
+        self.acc |= value << self.level
+        self.level += length
+        while self.level >= 32:
+            self.words.append(self.acc & 0xFFFFFFFF)
+            self.acc >>= 32
+            self.level -= 32
+
+    def flush(self):
+        if self.level:
+            self.words.append(self.acc)
+        self.acc = 0
+        self.level = 0
+        return self.words
+
+class BitReader:
+    def __init__(self, words, pos):
+        self.words = words
+        self.pos = pos * 32
+
+    def get(self, length):
+        value = 0
+        for i in range(length):
+            word = self.words[self.pos // 32]
+            value |= ((word >> (self.pos % 32)) & 1) << i
+            self.pos += 1
+        return value
+
+def next_k(acc, n):
+    for k in range(K_MAX + 1):
+        if (n << k) >= acc:
+            return k
+    return K_MAX
+
+def encode_frame(pixels, width, height):
+    # Returns (table, words) exactly as the gateware writes them
+    k = [[K_INIT, K_INIT], [K_INIT, K_INIT]]
+    table = []
+    words = []
+    for y in range(height):
+        line = pixels[y*width:(y+1)*width]
+        kl = k[y & 1]
+        bw = BitWriter()
+        bw.put((width * 5 // 4) | (kl[0] << 16) | (kl[1] << 20) | (HEADER_SYNC << 24), 32)
+        pred = [512, 512]
+        acc = [0, 0]
+        for x in range(0, width, 2):
+            for s in range(2):
+                e = line[x+s] - pred[s]
+                m = 2 * e if e >= 0 else -2 * e - 1
+                q = m >> kl[s]
+                if q < Q_ESCAPE:
+                    bw.put((1 << q) - 1, q + 1)
+                    bw.put(m & ((1 << kl[s]) - 1), kl[s])
+                else:
+                    bw.put((1 << Q_ESCAPE) - 1, Q_ESCAPE)
+                    bw.put(m, 11)
+                acc[s] += m
+                pred[s] = line[x+s]
+        k[y & 1] = [next_k(acc[s], width // 2) for s in range(2)]
+        table.append(len(words) * 4)
+        words += bw.flush()
+    return table, words
+
+def decode_line(words, offset, bad=False):
+    header = words[offset]
+    if (header >> 24) != HEADER_SYNC:
+        raise ValueError("bad line header {:08x} at byte offset {}".format(header, offset * 4))
+    width = (header & 0xFFFF) * 4 // 5
+    if bad:
+        return [0] * width
+    kl = [(header >> 16) & 0xF, (header >> 20) & 0xF]
+    br = BitReader(words, offset + 1)
+    pred = [512, 512]
+    line = []
+    for x in range(width):
+        s = x & 1
+        q = 0
+        while q < Q_ESCAPE and br.get(1):
+            q += 1
+        if q < Q_ESCAPE:
+            m = (q << kl[s]) | br.get(kl[s])
+        else:
+            m = br.get(11)
+        e = m >> 1 if (m & 1) == 0 else -((m + 1) >> 1)
+        pred[s] = (pred[s] + e) & 0x3FF
+        line.append(pred[s])
+    return line
+
+def parse_dump(filename):
+    # Lines of the firmware dump: "T <offset>..." for the line table, "D <word>..." for the data
+    table = []
+    words = []
+    with open(filename) as f:
+        for l in f:
+            fields = l.split()
+            if fields and fields[0] == "T":
+                table += [int(v, 16) for v in fields[1:]]
+            elif fields and fields[0] == "D":
+                words += [int(v, 16) for v in fields[1:]]
+    return table, words
+
+def print_stats(lines, width, out_bytes, fps):
+    in_bytes = lines * width * 5 // 4
+    print("{} lines of {} pixels: {} -> {} bytes, ratio {:.2f}, {:.2f} bits/pixel".format(
+        lines, width, in_bytes, out_bytes, in_bytes / out_bytes, 8 * out_bytes / (lines * width)))
+    if fps:
+        print("at {} fps: payload {:.1f} MB/s, compressed {:.1f} MB/s".format(
+            fps, in_bytes * fps / 1e6, out_bytes * fps / 1e6))
+
+def main():
+    parser = argparse.ArgumentParser(description="Reference codec for the LineCompressor")
+    sub = parser.add_subparsers(dest="cmd")
+    enc = sub.add_parser("encode", help="Compress a raw image and report statistics")
+    enc.add_argument("image", help="Raw image, 16-bit samples or packed RAW10")
+    enc.add_argument("width", type=int)
+    enc.add_argument("height", type=int)
+    enc.add_argument("--fps", type=float, default=30, help="Frame rate for the bandwidth estimate")
+    dec = sub.add_parser("decode", help="Decode a `compress dump` console log")
+    dec.add_argument("dump", help="Console log containing the dump")
+    dec.add_argument("-o", "--output", default=None, help="Write decoded pixels as 16-bit little-endian raw")
+    dec.add_argument("--check", default=None, help="Raw image to compare the decoded lines against")
+    dec.add_argument("--height", type=int, default=None, help="Height of the --check image if the dump was truncated")
+    dec.add_argument("--fps", type=float, default=0, help="Frame rate for the bandwidth estimate")
+    args = parser.parse_args()
+
+    if args.cmd == "encode":
+        pixels = load_raw(args.image, args.width, args.height)
+        table, words = encode_frame(pixels, args.width, args.height)
+        decoded = []
+        for offset in table:
+            decoded += decode_line(words, offset // 4)
+        if decoded != pixels:
+            print("round trip mismatch")
+            return 1
+        print_stats(args.height, args.width, len(words) * 4, args.fps)
+    elif args.cmd == "decode":
+        table, words = parse_dump(args.dump)
+        if not table:
+            print("no line table found in {}".format(args.dump))
+            return 1
+        pixels = []
+        bad_lines = []
+        for y, entry in enumerate(table):
+            bad = (entry & TABLE_BAD) != 0
+            pixels += decode_line(words, (entry & ~TABLE_BAD) // 4, bad)
+            if bad:
+                bad_lines.append(y)
+        width = len(pixels) // len(table)
+        print_stats(len(table), width, len(words) * 4, args.fps)
+        if bad_lines:
+            print("{} lines cut short upstream, zero filled: {}".format(len(bad_lines), bad_lines))
+        if args.output is not None:
+            save_raw(args.output, pixels)
+        if args.check is not None:
+            ref = load_raw(args.check, width, args.height or len(table))
+            bad = sum(1 for i, (a, b) in enumerate(zip(pixels, ref)) if a != b and i // width not in bad_lines)
+            print("{} of {} pixels differ from {}".format(bad, len(pixels) - len(bad_lines) * width, args.check))
+            if bad:
+                return 1
+    else:
+        parser.print_help()
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -1,7 +1,23 @@
 # The higher level parts of a MIPI CSI-2 receiver; non arch specific
 
 from migen import *
+from migen.genlib.cdc import MultiReg, PulseSynchronizer, GrayCounter, GrayDecoder
+from litex.soc.interconnect import stream
 from litex.soc.interconnect import wishbone
+from litex.soc.interconnect.csr import *
+from litex.soc.interconnect.csr_eventmanager import *
+
+# CSI-2 packet stream. The first beat of every packet is the raw 32-bit packet header (so short
+# packets are exactly one beat); for long packets it is followed by ceil(word_count / 4) payload
+# words, with the CRC dropped. The decoded header fields are carried as parameters.
+def csi_packet_description(data_width=32):
+	payload_layout = [("data", data_width)]
+	param_layout = [
+		("data_type", 6),
+		("virtual_channel", 2),
+		("word_count", 16),
+	]
+	return stream.EndpointDescription(payload_layout, param_layout)
 
 class WordAligner(Module):
 	def __init__(self, lane_width=8, num_lanes=4, depth=3):
@@ -34,73 +50,1617 @@ class WordAligner(Module):
 			self.sync.mipi += If(~sync_shift[pointers[i]][i], delayed_sync.eq(0))
 		self.sync.mipi += self.sync_out.eq(delayed_sync)
 
+class DPHYTrace(Module, AutoCSR):
+	# Logic analyser on the raw per-lane D-PHY output ahead of WordAligner, one sample per byte clock.
+	# Once armed it records continuously and stops `post` samples after the trigger sample, so up to
+	# depth - post - 1 samples of history precede it. Samples are read back one at a time through `index`
+	def __init__(self, data, sync, depth=1024):
+		num_lanes = len(sync)
+		self.control = CSRStorage(fields=[
+			CSRField("arm", size=1, offset=0, pulse=True),
+			CSRField("trigger", size=2, offset=1, description="0: immediately, 1: first sync on any lane, 2: sync on some lanes but not all"),
+		])
+		self.post = CSRStorage(16, reset=depth // 2, description="Samples recorded after the trigger, less than depth")
+		self.status = CSRStatus(fields=[
+			CSRField("done", size=1, offset=0),
+			CSRField("wrapped", size=1, offset=1, description="The whole buffer holds valid samples"),
+			CSRField("busy", size=1, offset=2, description="Set by arm, cleared once this trace is done; done alone may still be from the last one"),
+		])
+		self.trigger_index = CSRStatus(16, description="Buffer index of the trigger sample")
+		self.index = CSRStorage(16, description="Sample to read back")
+		self.sample_data = CSRStatus(len(data))
+		self.sample_sync = CSRStatus(num_lanes)
+
+		self.specials.mem = Memory(len(data) + num_lanes, depth)
+		wr_port = self.mem.get_port(write_capable=True, clock_domain="mipi")
+		rd_port = self.mem.get_port()
+		self.specials += wr_port, rd_port
+		self.comb += [
+			rd_port.adr.eq(self.index.storage),
+			self.sample_data.status.eq(rd_port.dat_r[0:len(data)]),
+			self.sample_sync.status.eq(rd_port.dat_r[len(data):]),
+		]
+
+		# control into the mipi domain
+		self.submodules.arm_ps = arm_ps = PulseSynchronizer("sys", "mipi")
+		mode = Signal(2)
+		post = Signal(16)
+		self.comb += arm_ps.i.eq(self.control.fields.arm)
+		self.specials += [
+			MultiReg(self.control.fields.trigger, mode, "mipi"),
+			MultiReg(self.post.storage, post, "mipi"),
+		]
+
+		data_r = Signal(len(data))
+		sync_r = Signal(num_lanes)
+		running = Signal()
+		triggered = Signal()
+		done = Signal()
+		wrapped = Signal()
+		wptr = Signal(max=depth)
+		trigger_index = Signal(max=depth)
+		remaining = Signal(16)
+		hit = Signal()
+		self.comb += [
+			Case(mode, {
+				0: hit.eq(1),
+				1: hit.eq(sync_r != 0),
+				2: hit.eq((sync_r != 0) & (sync_r != 2**num_lanes - 1)),
+				"default": hit.eq(0),
+			}),
+			wr_port.adr.eq(wptr),
+			wr_port.dat_w.eq(Cat(data_r, sync_r)),
+			wr_port.we.eq(running),
+		]
+		self.sync.mipi += [
+			data_r.eq(data),
+			sync_r.eq(sync),
+			If(arm_ps.o,
+				running.eq(1),
+				triggered.eq(0),
+				done.eq(0),
+				wrapped.eq(0),
+				wptr.eq(0),
+			).Elif(running,
+				If(wptr == depth - 1,
+					wptr.eq(0),
+					wrapped.eq(1)
+				).Else(
+					wptr.eq(wptr + 1)
+				),
+				If(~triggered & hit,
+					triggered.eq(1),
+					trigger_index.eq(wptr),
+					remaining.eq(post),
+					If(post == 0,
+						running.eq(0),
+						done.eq(1)
+					)
+				).Elif(triggered,
+					remaining.eq(remaining - 1),
+					If(remaining == 1,
+						running.eq(0),
+						done.eq(1)
+					)
+				)
+			)
+		]
+
+		# trigger_index is stable long before done rises
+		done_sys = Signal()
+		done_sys_d = Signal()
+		busy = Signal()
+		self.specials += [
+			MultiReg(done, done_sys),
+			MultiReg(wrapped, self.status.fields.wrapped),
+			MultiReg(trigger_index, self.trigger_index.status),
+		]
+		self.comb += [
+			self.status.fields.done.eq(done_sys),
+			self.status.fields.busy.eq(busy),
+		]
+		# arm clears done in the mipi domain some cycles later, so only a rising edge seen after arm ends busy
+		self.sync += [
+			done_sys_d.eq(done_sys),
+			If(self.control.fields.arm,
+				busy.eq(1)
+			).Elif(done_sys & ~done_sys_d,
+				busy.eq(0)
+			)
+		]
+
+class CSI2PacketParser(Module):
+	# Splits the aligned word stream from WordAligner into packets, in the mipi domain.
+	# The D-PHY can't be stalled, so source.ready is ignored here; see CSI2Stream for overflow handling
+	def __init__(self, data, data_sync):
+		self.source = source = stream.Endpoint(csi_packet_description(len(data)))
+		words_left = Signal(15)
+		data_type = data[0:6]
+		word_count = data[8:24]
+		is_short = Signal()
+		self.comb += is_short.eq(data_type < 0x10)
+		self.sync.mipi += [
+			source.valid.eq(0),
+			source.first.eq(0),
+			source.last.eq(0),
+			source.data.eq(data),
+			If(data_sync,
+				source.valid.eq(1),
+				source.first.eq(1),
+				source.last.eq(is_short | (word_count == 0)),
+				source.data_type.eq(data_type),
+				source.virtual_channel.eq(data[6:8]),
+				source.word_count.eq(word_count),
+				If(is_short,
+					words_left.eq(0)
+				).Else(
+					words_left.eq((word_count + 3) >> 2)
+				)
+			).Elif(words_left != 0,
+				source.valid.eq(1),
+				source.last.eq(words_left == 1),
+				words_left.eq(words_left - 1)
+			)
+		]
+
+class CSI2Stream(Module, AutoCSR):
+	# Packet parser plus the mipi -> sys clock domain crossing; everything downstream of source runs in sys.
+	# If the FIFO fills, the rest of the current packet is dropped and counted, so consumers see a packet
+	# without its last beat and resynchronise on the next first.
+	def __init__(self, data, data_sync, fifo_depth=64):
+		self.submodules.parser = parser = CSI2PacketParser(data, data_sync)
+		description = csi_packet_description(len(data))
+		self.submodules.fifo = fifo = ClockDomainsRenamer({"write": "mipi", "read": "sys"})(
+			stream.AsyncFIFO(description, fifo_depth, buffered=True))
+		self.source = source = stream.Endpoint(description)
+
+		self.overflows = CSRStatus(32, description="Number of packets truncated or lost due to FIFO overflow")
+		self.header = CSRStatus(32, description="Header of the last packet to reach the sys domain")
+
+		dropping = Signal()
+		blocked = Signal()
+		overflow = Signal()
+		self.comb += [
+			parser.source.connect(fifo.sink, omit={"valid", "ready"}),
+			blocked.eq(dropping & ~parser.source.first),
+			fifo.sink.valid.eq(parser.source.valid & ~blocked),
+			overflow.eq(fifo.sink.valid & ~fifo.sink.ready),
+			fifo.source.connect(source),
+		]
+		self.sync.mipi += If(parser.source.valid & ~blocked, dropping.eq(~fifo.sink.ready))
+
+		# count in mipi domain, pass across as gray code
+		overflow_count = ClockDomainsRenamer("mipi")(GrayCounter(32))
+		self.submodules += overflow_count
+		overflow_gray = Signal(32)
+		overflow_decoder = GrayDecoder(32)
+		self.submodules += overflow_decoder
+		self.comb += overflow_count.ce.eq(overflow)
+		self.specials += MultiReg(overflow_count.q, overflow_gray, "sys")
+		self.comb += [
+			overflow_decoder.i.eq(overflow_gray),
+			self.overflows.status.eq(overflow_decoder.o),
+		]
+
+		self.sync += If(source.valid & source.ready & source.first, self.header.status.eq(source.data))
+
+class StreamBroadcast(Module):
+	# Forwards every beat of sink to all sources; the beat completes once each source has accepted it
+	def __init__(self, description, n):
+		self.sink = sink = stream.Endpoint(description)
+		self.sources = sources = [stream.Endpoint(description) for i in range(n)]
+		done = Signal(n)
+		accepted = Signal(n)
+		for i in range(n):
+			self.comb += [
+				sink.connect(sources[i], omit={"valid", "ready"}),
+				sources[i].valid.eq(sink.valid & ~done[i]),
+				accepted[i].eq(done[i] | sources[i].ready),
+			]
+		self.comb += sink.ready.eq(accepted == (2**n - 1))
+		self.sync += [
+			If(sink.valid & sink.ready,
+				done.eq(0)
+			).Else(
+				done.eq(done | Cat(*[s.valid & s.ready for s in sources]))
+			)
+		]
+
 class PacketCapture(Module):
-	def __init__(self,  data, data_sync, depth=128):
-		self.specials.mem = Memory(len(data), depth)
-		port = self.mem.get_port(write_capable=True, clock_domain="mipi")
+	# Records the header and the start of the payload of the most recent packet
+	def __init__(self, data_width=32, depth=128):
+		self.sink = sink = stream.Endpoint(csi_packet_description(data_width))
+		self.specials.mem = Memory(data_width, depth)
+		port = self.mem.get_port(write_capable=True)
 		self.specials += port
 		write_ptr = Signal(32)
-		self.sync.mipi += [
-			If(data_sync, write_ptr.eq(0)).Else(write_ptr.eq(write_ptr + 1)),
-			port.dat_w.eq(data)
+		self.comb += sink.ready.eq(1)
+		self.sync += [
+			port.we.eq(0),
+			If(sink.valid,
+				If(sink.first,
+					port.adr.eq(0),
+					port.we.eq(1),
+					write_ptr.eq(1)
+				).Else(
+					port.adr.eq(write_ptr),
+					port.we.eq(write_ptr < depth),
+					write_ptr.eq(write_ptr + 1)
+				)
+			),
+			port.dat_w.eq(sink.data)
 		]
+
+class PatternChecker(Module, AutoCSR):
+	# Compares received RAW10 lines against the IMX258 solid colour / 100% colour bar test patterns,
+	# byte by byte, and counts bit errors per lane (byte n of a packet is carried on lane n % num_lanes).
+	# The expected pattern is periodic in 16 pixel (5 word) groups, so bar_width is given in groups.
+	# Checking starts at the second frame start after `start`, so the frame in flight when the test pattern
+	# was enabled is never checked
+	def __init__(self, data_width=32, num_lanes=4):
+		self.sink = sink = stream.Endpoint(csi_packet_description(data_width))
+		self.control = CSRStorage(fields=[
+			CSRField("start", size=1, offset=0, pulse=True, description="Clear counters and check the next `frames` frames"),
+			CSRField("mode", size=2, offset=1, description="1: solid colour, 2: colour bars"),
+			CSRField("order", size=2, offset=3, description="Bit 0 swaps columns, bit 1 swaps rows of the R/Gr/Gb/B layout"),
+		])
+		self.frames = CSRStorage(16)
+		self.bar_width = CSRStorage(16, reset=15)
+		self.colour_r = CSRStorage(10)
+		self.colour_gr = CSRStorage(10)
+		self.colour_gb = CSRStorage(10)
+		self.colour_b = CSRStorage(10)
+		self.status = CSRStatus(fields=[
+			CSRField("done", size=1, offset=0),
+			CSRField("frames", size=16, offset=16, description="Frames checked so far"),
+		])
+		lane_errors = []
+		lane_bytes = []
+		for i in range(num_lanes):
+			errors = CSRStatus(32, name="errors{}".format(i))
+			nbytes = CSRStatus(32, name="bytes{}".format(i))
+			setattr(self, "errors{}".format(i), errors)
+			setattr(self, "bytes{}".format(i), nbytes)
+			lane_errors.append(errors)
+			lane_bytes.append(nbytes)
+
+		self.comb += sink.ready.eq(1)
+
+		armed = Signal()
+		skip = Signal()
+		running = Signal()
+		remaining = Signal(16)
+		checked = Signal(16)
 		self.comb += [
-			port.adr.eq(write_ptr),
-			port.we.eq(write_ptr < depth)
+			self.status.fields.done.eq(~armed & ~running),
+			self.status.fields.frames.eq(checked),
 		]
 
-class ImageCapture(Module):
-	def __init__(self,  data, data_sync, subsample_x=5, subsample_y=20, out_width=120, out_height=54):
 		is_pixels = Signal()
-		subx_ctr = Signal(max=subsample_x)
-		suby_ctr = Signal(max=subsample_y)
-		out_x = Signal(16)
-		out_y = Signal(16)
-		x_hit = Signal()
-		y_hit = Signal()
-		self.last_line_count = Signal(16)
-		line_count = Signal(16)
-		self.specials.mem = Memory(16, out_width * out_height)
-		port = self.mem.get_port(write_capable=True, clock_domain="mipi")
+		odd_row = Signal()
+		phase = Signal(max=5)
+		group = Signal(16)
+		bar = Signal(3)
+		words_left = Signal(15)
+		last_bytes = Signal(log2_int(num_lanes))
+
+		# 100% colour bars: white, yellow, cyan, green, magenta, red, blue, black as (R, G, B)
+		bars = [(1, 1, 1), (1, 1, 0), (0, 1, 1), (0, 1, 0), (1, 0, 1), (1, 0, 0), (0, 0, 1), (0, 0, 0)]
+		bar_r = Signal(10)
+		bar_g = Signal(10)
+		bar_b = Signal(10)
+		self.comb += Case(bar, {i: [
+				bar_r.eq(0x3FF * r),
+				bar_g.eq(0x3FF * g),
+				bar_b.eq(0x3FF * b),
+			] for i, (r, g, b) in enumerate(bars)})
+
+		# pixel values for even/odd columns of the current row
+		col0 = Signal(10)
+		col1 = Signal(10)
+		r = Signal(10)
+		gr = Signal(10)
+		gb = Signal(10)
+		b = Signal(10)
+		self.comb += [
+			If(self.control.fields.mode == 2,
+				r.eq(bar_r), gr.eq(bar_g), gb.eq(bar_g), b.eq(bar_b)
+			).Else(
+				r.eq(self.colour_r.storage), gr.eq(self.colour_gr.storage),
+				gb.eq(self.colour_gb.storage), b.eq(self.colour_b.storage)
+			),
+			If(odd_row ^ self.control.fields.order[1],
+				If(self.control.fields.order[0], col0.eq(b), col1.eq(gb)).Else(col0.eq(gb), col1.eq(b))
+			).Else(
+				If(self.control.fields.order[0], col0.eq(gr), col1.eq(r)).Else(col0.eq(r), col1.eq(gr))
+			)
+		]
+
+		# RAW10 packing: four MSB bytes then one byte of LSBs, repeating every 5 bytes; 20 bytes span 5 words
+		msb0 = col0[2:10]
+		msb1 = col1[2:10]
+		lsbs = Cat(col0[0:2], col1[0:2], col0[0:2], col1[0:2])
+		group_bytes = [lsbs if (k % 5) == 4 else (msb0 if (k % 5) % 2 == 0 else msb1) for k in range(20)]
+		expected = Signal(data_width)
+		self.comb += Case(phase, {w: expected.eq(Cat(*group_bytes[4*w:4*w+4])) for w in range(5)})
+
+		diff = Signal(data_width)
+		lane_valid = Signal(num_lanes)
+		self.comb += [
+			diff.eq(sink.data ^ expected),
+			lane_valid.eq(2**num_lanes - 1),
+			# the final word of a line is only partly payload
+			If(words_left == 1,
+				Case(last_bytes, {n: lane_valid.eq((1 << n) - 1) for n in range(1, num_lanes)})
+			)
+		]
+		check = Signal()
+		self.comb += check.eq(sink.valid & ~sink.first & is_pixels & running)
+
+		self.sync += [
+			If(self.control.fields.start,
+				armed.eq(1),
+				skip.eq(1),
+				running.eq(0),
+				remaining.eq(self.frames.storage),
+				checked.eq(0),
+			),
+			If(sink.valid & sink.first,
+				If(sink.data_type == 0x2B, # RAW10 pixel data
+					is_pixels.eq(1),
+					odd_row.eq(~odd_row),
+					phase.eq(0),
+					group.eq(0),
+					bar.eq(0),
+					words_left.eq((sink.word_count + 3) >> 2),
+					last_bytes.eq(sink.word_count[0:log2_int(num_lanes)]),
+				).Else(
+					is_pixels.eq(0),
+					If(sink.data_type == 0x00, # frame start
+						odd_row.eq(1),
+						If(armed & skip,
+							skip.eq(0)
+						).Elif(armed,
+							armed.eq(0),
+							running.eq(remaining != 0),
+						).Elif(running,
+							checked.eq(checked + 1),
+							remaining.eq(remaining - 1),
+							If(remaining == 1, running.eq(0))
+						)
+					)
+				)
+			).Elif(sink.valid,
+				words_left.eq(words_left - 1),
+				If(phase == 4,
+					phase.eq(0),
+					If(group == self.bar_width.storage - 1,
+						group.eq(0),
+						bar.eq(bar + 1)
+					).Else(
+						group.eq(group + 1)
+					)
+				).Else(
+					phase.eq(phase + 1)
+				)
+			)
+		]
+
+		for i in range(num_lanes):
+			lane_diff = diff[8*i:8*(i+1)]
+			popcount = Signal(4)
+			self.comb += popcount.eq(sum(lane_diff[j] for j in range(8)))
+			self.sync += [
+				If(self.control.fields.start,
+					lane_errors[i].status.eq(0),
+					lane_bytes[i].status.eq(0),
+				).Elif(check & lane_valid[i],
+					lane_errors[i].status.eq(lane_errors[i].status + popcount),
+					lane_bytes[i].status.eq(lane_bytes[i].status + 1),
+				)
+			]
+
+class ROICapture(Module, AutoCSR):
+	# Captures an unsubsampled width x height window of packed RAW10 payload, once per arm.
+	# x is in 16 pixel (5 word) units so the window starts on a word boundary; x/y are latched at frame start
+	def __init__(self, data_width=32, width=256, height=128):
+		assert (width * 5) % 16 == 0
+		self.sink = sink = stream.Endpoint(csi_packet_description(data_width))
+		self.x = CSRStorage(16, description="Window start, in 16 pixel units")
+		self.y = CSRStorage(16, description="Window start line")
+		self.control = CSRStorage(fields=[
+			CSRField("arm", size=1, offset=0, pulse=True, description="Capture the window from the next frame"),
+		])
+		self.status = CSRStatus(fields=[
+			CSRField("done", size=1, offset=0),
+			CSRField("complete", size=1, offset=1, description="Whole window was inside the last frame"),
+			CSRField("clipped", size=1, offset=2, description="A window line ended before the right edge of the window"),
+		])
+
+		line_words = (width * 5) // 16
+		self.specials.mem = Memory(data_width, line_words * height)
+		port = self.mem.get_port(write_capable=True)
 		self.specials += port
-		data_type = data[0:8]
+
+		armed = Signal()
+		active = Signal()
+		done = Signal(reset=1)
+		complete = Signal()
+		clipped = Signal()
+		short = Signal()
+		x_start = Signal(16)
+		y_start = Signal(16)
+		line = Signal(16)
+		word = Signal(16)
+		out_line = Signal(max=height + 1)
+		in_window = Signal()
+		next_line = Signal(16)
 		self.comb += [
-			x_hit.eq(subx_ctr == 0),
-			y_hit.eq(suby_ctr == 0),
+			sink.ready.eq(1),
+			next_line.eq(line + 1),
+			self.status.fields.done.eq(done),
+			self.status.fields.complete.eq(complete),
+			self.status.fields.clipped.eq(clipped),
+			# the window line just received stopped short of the window, either because its word count is too
+			# small or because the packet was cut off by a FIFO overflow
+			short.eq(in_window & (word < x_start + line_words)),
 		]
-		self.sync.mipi += [
-			If(x_hit,
-				out_x.eq(out_x + 1)
+
+		self.sync += [
+			port.we.eq(0),
+			If(self.control.fields.arm,
+				armed.eq(1),
+				done.eq(0),
+				complete.eq(0),
+				clipped.eq(0),
+			),
+			If(sink.valid & sink.first,
+				word.eq(0),
+				If(short, clipped.eq(1)),
+				# any packet after the last window line finishes the window, including the frame end packet
+				# when the window reaches the bottom of the frame
+				If(in_window & (out_line == height - 1),
+					active.eq(0),
+					done.eq(1),
+					complete.eq(~short & ~clipped)
+				),
+				If(sink.data_type == 0x2B, # RAW10 pixel data
+					line.eq(next_line),
+					in_window.eq(active & (next_line >= y_start) & (next_line < y_start + height)),
+					out_line.eq(next_line - y_start),
+					If(active & (next_line >= y_start) & (next_line < y_start + height) &
+						(sink.word_count < (x_start + line_words) * 4),
+						clipped.eq(1)
+					)
+				).Else(
+					in_window.eq(0),
+					If(sink.data_type == 0x00, # frame start
+						line.eq(0xFFFF),
+						If(active,
+							# window ran off the end of the last frame
+							active.eq(0),
+							done.eq(1)
+						),
+						If(armed,
+							armed.eq(0),
+							active.eq(1),
+							x_start.eq(self.x.storage * 5),
+							y_start.eq(self.y.storage)
+						)
+					)
+				)
+			).Elif(sink.valid,
+				word.eq(word + 1),
+				If(in_window & (word >= x_start) & (word < x_start + line_words),
+					port.we.eq(1)
+				)
 			),
-			If(subx_ctr == subsample_x - 1,
-				subx_ctr.eq(0)
+			port.adr.eq(out_line * line_words + word - x_start),
+			port.dat_w.eq(sink.data)
+		]
+
+# Lossless line compression --------------------------------------------------------------------------
+# Each RAW10 line is coded independently: a header word (0xA5, k for each column parity, byte count), then one
+# Golomb-Rice code per pixel of the DPCM residual against the previous pixel of the same colour (512 for the
+# first), LSB first, padded to a 32-bit boundary. A line that was cut short upstream ends with a zero word and
+# is marked bad (bit 31) in the line table. line_codec.py is the matching host-side reference
+
+def pixel_pair_description():
+	# error is set on the closing beat of a line that was cut short; its pixels are not valid
+	return stream.EndpointDescription([("p0", 10), ("p1", 10), ("error", 1)], [("word_count", 16)])
+
+def code_description():
+	return stream.EndpointDescription([("bits", 54), ("len", 6), ("error", 1)])
+
+def word_description():
+	return stream.EndpointDescription([("data", 32), ("error", 1)])
+
+class RAW10Unpacker(Module):
+	# Turns RAW10 line packets into a stream of pixel pairs (one Bayer column pair per beat); other packets are dropped.
+	# Every RAW10 line ends with exactly one last beat: if the next packet starts before a line is finished (CSI2Stream
+	# dropped its tail), the line is closed with an error beat before the new packet is taken
+	def __init__(self, data_width=32):
+		self.sink = sink = stream.Endpoint(csi_packet_description(data_width))
+		self.source = source = stream.Endpoint(pixel_pair_description())
+
+		buf = Signal(72)
+		level = Signal(4) # bytes held in buf
+		in_line = Signal()
+		bytes_left = Signal(16)
+		group = Signal(40)
+		group_valid = Signal()
+		group_last = Signal()
+		half = Signal()
+		first_pending = Signal()
+		line_open = Signal()
+		cut = Signal()
+
+		take = Signal()
+		accept = Signal()
+		pos = Signal(4)
+		shifted = Signal(72)
+		self.comb += [
+			take.eq((level >= 5) & in_line & (~group_valid | (source.ready & half))),
+			cut.eq(sink.valid & sink.first & line_open & ~group_valid & ~take),
+			If(sink.first,
+				sink.ready.eq(~group_valid & ~line_open)
 			).Else(
-				subx_ctr.eq(subx_ctr + 1)
+				sink.ready.eq(~in_line | (level <= 5))
 			),
-			If(data_sync,
-				If(data_type == 0x2B, # RAW10 pixel data
-					If(suby_ctr == subsample_y - 1,
-						suby_ctr.eq(0),
-						out_y.eq(out_y + 1)
+			accept.eq(sink.valid & sink.ready & ~sink.first & in_line & (bytes_left != 0)),
+			pos.eq(level - Mux(take, 5, 0)),
+			Case(pos, {i: shifted.eq(sink.data << (8 * i)) for i in range(6)}),
+		]
+
+		pixels = [Cat(group[32+2*i:34+2*i], group[8*i:8*(i+1)]) for i in range(4)]
+		self.comb += [
+			source.valid.eq(group_valid | cut),
+			source.p0.eq(Mux(half, pixels[2], pixels[0])),
+			source.p1.eq(Mux(half, pixels[3], pixels[1])),
+			source.error.eq(cut),
+			source.first.eq(first_pending & ~half),
+			source.last.eq((group_last & half) | cut),
+		]
+
+		self.sync += [
+			If(source.valid & source.ready,
+				If(group_valid,
+					half.eq(~half),
+					If(half, group_valid.eq(0))
+				),
+				first_pending.eq(0),
+				If(source.last, line_open.eq(0))
+			),
+			If(sink.valid & sink.ready & sink.first,
+				in_line.eq(sink.data_type == 0x2B), # RAW10 pixel data
+				line_open.eq(sink.data_type == 0x2B),
+				bytes_left.eq(sink.word_count),
+				source.word_count.eq(sink.word_count),
+				level.eq(0),
+				buf.eq(0),
+				first_pending.eq(1),
+			).Else(
+				If(take,
+					group.eq(buf[0:40]),
+					group_valid.eq(1),
+					group_last.eq(bytes_left < 10),
+					bytes_left.eq(bytes_left - 5),
+					If(bytes_left < 10,
+						# discard CRC bytes and padding after the final group
+						in_line.eq(0),
+						level.eq(0),
+						buf.eq(0)
 					).Else(
-						suby_ctr.eq(suby_ctr + 1)
-					),
-					out_x.eq(0),
-					subx_ctr.eq(0),
-					is_pixels.eq(1),
-					line_count.eq(line_count + 1),
+						buf.eq(Mux(accept, shifted, 0) | buf[40:72]),
+						level.eq(level - 5 + Mux(accept, 4, 0))
+					)
+				).Elif(accept,
+					buf.eq(shifted | buf),
+					level.eq(level + 4)
+				)
+			)
+		]
+
+def _rice_code(m, k):
+	# Golomb-Rice code of an 11-bit value: q ones, a zero, then k remainder bits; q >= 16 escapes to 16 ones and m raw
+	q = Signal(11)
+	q4 = Signal(4)
+	ones = Signal(16)
+	rem = Signal(10)
+	code = Signal(27)
+	length = Signal(5)
+	return [
+		q.eq(m >> k),
+		q4.eq(q[0:4]),
+		ones.eq((C(1, 1) << q4) - 1),
+		rem.eq(m & ((C(1, 1) << k) - 1)),
+		If(q < 16,
+			code.eq(ones | (rem << (q4 + 1))),
+			length.eq(q4 + 1 + k)
+		).Else(
+			code.eq(0xFFFF | (m << 16)),
+			length.eq(27)
+		)
+	], code, length
+
+class RiceEncoder(Module):
+	# DPCM + Golomb-Rice coder, one pixel pair per cycle. k for each column parity comes from the mean residual of
+	# the previous line of the same Bayer row type (A/N rule from LOCO-I) and is sent in the line header. The error
+	# beat of a cut line becomes a zero word that ends the line, and leaves k unchanged
+	def __init__(self, k_init=4):
+		self.sink = sink = stream.Endpoint(pixel_pair_description())
+		self.source = source = stream.Endpoint(code_description())
+
+		parity = Signal()
+		k = [[Signal(4, reset=k_init) for s in range(2)] for p in range(2)]
+		k_line = [Signal(4) for s in range(2)]
+		pred = [Signal(10) for s in range(2)]
+		acc = [Signal(32) for s in range(2)]
+		count = Signal(16)
+		header_sent = Signal()
+
+		# residuals, mapped to unsigned
+		pix = [sink.p0, sink.p1]
+		m = [Signal(11) for s in range(2)]
+		codes = []
+		for s in range(2):
+			e = Signal((11, True))
+			self.comb += [
+				e.eq(pix[s] - Mux(sink.first, 512, pred[s])),
+				If(e >= 0,
+					m[s].eq(e << 1)
 				).Else(
-					is_pixels.eq(0),
-					If(data_type == 0x00, # frame start
-						suby_ctr.eq(0),
-						out_y.eq(0xFFFF),
-						line_count.eq(0),
-						self.last_line_count.eq(line_count),
+					m[s].eq((-e << 1) - 1)
+				)
+			]
+			stmts, code, length = _rice_code(m[s], k_line[s])
+			self.comb += stmts
+			codes.append((code, length))
+
+		pair_bits = Signal(54)
+		pair_len = Signal(6)
+		header = Signal(32)
+		k_header = [Array(k[p][s] for p in range(2))[parity] for s in range(2)]
+		self.comb += [
+			pair_bits.eq(codes[0][0] | (codes[1][0] << codes[0][1])),
+			pair_len.eq(codes[0][1] + codes[1][1]),
+			header.eq(Cat(sink.word_count, k_header[0], k_header[1], C(0xA5, 8))),
+		]
+
+		# new k once a line is finished: smallest k with count << k >= acc
+		fin_acc = [Signal(32) for s in range(2)]
+		fin_count = Signal(16)
+		fin_parity = Signal()
+		fin_pending = Signal()
+		for s in range(2):
+			k_new = Signal(4)
+			self.comb += k_new.eq(10)
+			for i in reversed(range(11)):
+				self.comb += If((fin_count << i) >= fin_acc[s], k_new.eq(i))
+			self.sync += If(fin_pending,
+				If(fin_parity, k[1][s].eq(k_new)).Else(k[0][s].eq(k_new))
+			)
+		self.sync += fin_pending.eq(0)
+
+		load = Signal()
+		self.comb += [
+			load.eq(~source.valid | source.ready),
+			sink.ready.eq(load & (header_sent | ~sink.first)),
+		]
+		self.sync += [
+			If(load,
+				source.valid.eq(0),
+				If(sink.valid & sink.first & ~header_sent,
+					source.valid.eq(1),
+					source.first.eq(1),
+					source.last.eq(0),
+					source.bits.eq(header),
+					source.len.eq(32),
+					source.error.eq(0),
+					header_sent.eq(1),
+					k_line[0].eq(k_header[0]),
+					k_line[1].eq(k_header[1]),
+				).Elif(sink.valid & sink.error,
+					source.valid.eq(1),
+					source.first.eq(0),
+					source.last.eq(1),
+					source.bits.eq(0),
+					source.len.eq(32),
+					source.error.eq(1),
+					header_sent.eq(0),
+					parity.eq(~parity)
+				).Elif(sink.valid,
+					source.valid.eq(1),
+					source.first.eq(0),
+					source.last.eq(sink.last),
+					source.bits.eq(pair_bits),
+					source.len.eq(pair_len),
+					source.error.eq(0),
+					header_sent.eq(0),
+					pred[0].eq(sink.p0),
+					pred[1].eq(sink.p1),
+					If(sink.first,
+						acc[0].eq(m[0]),
+						acc[1].eq(m[1]),
+						count.eq(1)
+					).Else(
+						acc[0].eq(acc[0] + m[0]),
+						acc[1].eq(acc[1] + m[1]),
+						count.eq(count + 1)
 					),
+					If(sink.last,
+						fin_acc[0].eq(Mux(sink.first, m[0], acc[0] + m[0])),
+						fin_acc[1].eq(Mux(sink.first, m[1], acc[1] + m[1])),
+						fin_count.eq(Mux(sink.first, 1, count + 1)),
+						fin_parity.eq(parity),
+						fin_pending.eq(1),
+						parity.eq(~parity)
+					)
+				)
+			)
+		]
+
+class BitPacker(Module):
+	# Packs variable length codes into 32-bit words, LSB first; each line ends padded to a word boundary.
+	# The error flag of a line's last code is passed on with its last word
+	def __init__(self):
+		self.sink = sink = stream.Endpoint(code_description())
+		self.source = source = stream.Endpoint(word_description())
+
+		acc = Signal(96)
+		level = Signal(7)
+		flush = Signal()
+		error = Signal()
+		first_pending = Signal()
+		out_fire = Signal()
+		in_fire = Signal()
+		out_take = Signal(7)
+		shift = Signal(7)
+		self.comb += [
+			source.valid.eq((level >= 32) | (flush & (level != 0))),
+			source.data.eq(acc[0:32]),
+			source.first.eq(first_pending),
+			source.last.eq(flush & (level <= 32)),
+			source.error.eq(error),
+			out_fire.eq(source.valid & source.ready),
+			sink.ready.eq(~flush & (level <= 42)),
+			in_fire.eq(sink.valid & sink.ready),
+			If(out_fire,
+				If(level >= 32, out_take.eq(32)).Else(out_take.eq(level))
+			),
+			shift.eq(level - out_take),
+		]
+		self.sync += [
+			acc.eq(Mux(out_fire, acc[32:96], acc) | Mux(in_fire, sink.bits << shift, 0)),
+			level.eq(level - out_take + Mux(in_fire, sink.len, 0)),
+			If(out_fire, first_pending.eq(0)),
+			If(in_fire & sink.first, first_pending.eq(1)),
+			If(in_fire & sink.last,
+				flush.eq(1),
+				error.eq(sink.error)
+			).Elif(flush & out_fire & (level <= 32),
+				flush.eq(0)
+			)
+		]
+
+class LineWriter(Module):
+	# Writes packed lines to memory over Wishbone. Once a line's last word is written its byte offset from
+	# data_base goes into the line table, with bit 31 set if the line was cut short
+	def __init__(self, bus):
+		self.sink = sink = stream.Endpoint(word_description())
+		self.data_base = Signal(30) # word addresses
+		self.table_base = Signal(30)
+		self.data_size = Signal(30) # words
+		self.words = Signal(30)
+		self.lines = Signal(16)
+		self.bad_lines = Signal(16)
+		self.bad_words = Signal(30) # words of the bad lines, included in words
+		self.full = Signal()
+
+		line_start = Signal(30)
+		line_error = Signal()
+		table_pending = Signal()
+		self.comb += [
+			self.full.eq(self.words >= self.data_size),
+			If(table_pending,
+				bus.adr.eq(self.table_base + self.lines),
+				bus.dat_w.eq(Cat(C(0, 2), line_start[:29], line_error))
+			).Else(
+				bus.adr.eq(self.data_base + self.words),
+				bus.dat_w.eq(sink.data)
+			),
+			bus.cyc.eq(table_pending | (sink.valid & ~self.full)),
+			bus.stb.eq(table_pending | (sink.valid & ~self.full)),
+			bus.we.eq(1),
+			bus.sel.eq(0xF),
+			sink.ready.eq(bus.ack & ~table_pending),
+		]
+		self.sync += [
+			If(bus.ack,
+				If(table_pending,
+					table_pending.eq(0),
+					self.lines.eq(self.lines + 1),
+					If(line_error,
+						self.bad_lines.eq(self.bad_lines + 1),
+						self.bad_words.eq(self.bad_words + self.words - line_start)
+					)
+				).Else(
+					self.words.eq(self.words + 1),
+					If(sink.first, line_start.eq(self.words)),
+					If(sink.last,
+						table_pending.eq(1),
+						line_error.eq(sink.error)
+					)
+				)
+			)
+		]
+
+class LineCompressor(Module, AutoCSR):
+	# Compresses one frame into memory per arm. Never back-pressures the CSI stream: if the input FIFO fills
+	# (memory too slow), capture stops and `lines` tells how many lines were stored. Lines that lost their tail
+	# in CSI2Stream are still stored, ending early, and counted in `bad_lines`
+	def __init__(self, bus, data_width=32, fifo_depth=1024):
+		self.sink = sink = stream.Endpoint(csi_packet_description(data_width))
+		self.control = CSRStorage(fields=[
+			CSRField("arm", size=1, offset=0, pulse=True, description="Compress the next frame"),
+		])
+		self.data_base = CSRStorage(32, description="Byte address of compressed line data")
+		self.data_size = CSRStorage(32, description="Bytes available at data_base")
+		self.table_base = CSRStorage(32, description="Byte address of the line offset table (one word per line)")
+		self.status = CSRStatus(fields=[
+			CSRField("done", size=1, offset=0),
+			CSRField("overflow", size=1, offset=1, description="Input FIFO or memory ran out before the frame end"),
+		])
+		self.lines = CSRStatus(16, description="Lines stored, including bad ones")
+		self.bad_lines = CSRStatus(16, description="Stored lines that were cut short upstream, marked in the line table")
+		self.in_bytes = CSRStatus(32, description="RAW10 payload bytes of the stored lines that are not bad")
+		self.out_bytes = CSRStatus(32, description="Compressed bytes written, including headers and padding")
+		self.bad_bytes = CSRStatus(32, description="Part of out_bytes taken by bad lines; in_bytes has no counterpart")
+		self.cycles = CSRStatus(32, description="sys clock cycles from frame start to done")
+
+		arm = self.control.fields.arm
+		self.submodules.fifo = fifo = ResetInserter()(stream.SyncFIFO(csi_packet_description(data_width), fifo_depth, buffered=True))
+		self.submodules.unpacker = unpacker = ResetInserter()(RAW10Unpacker(data_width))
+		self.submodules.encoder = encoder = ResetInserter()(RiceEncoder())
+		self.submodules.packer = packer = ResetInserter()(BitPacker())
+		self.submodules.out_fifo = out_fifo = ResetInserter()(stream.SyncFIFO(word_description(), 512, buffered=True))
+		self.submodules.writer = writer = ResetInserter()(LineWriter(bus))
+		for m in [fifo, unpacker, encoder, packer, out_fifo, writer]:
+			self.comb += m.reset.eq(arm)
+		self.comb += [
+			fifo.source.connect(unpacker.sink),
+			unpacker.source.connect(encoder.sink),
+			encoder.source.connect(packer.sink),
+			packer.source.connect(out_fifo.sink),
+			out_fifo.source.connect(writer.sink),
+			writer.data_base.eq(self.data_base.storage[2:32]),
+			writer.data_size.eq(self.data_size.storage[2:32]),
+			writer.table_base.eq(self.table_base.storage[2:32]),
+			self.lines.status.eq(writer.lines),
+			self.bad_lines.status.eq(writer.bad_lines),
+			self.out_bytes.status.eq(writer.words << 2),
+			self.bad_bytes.status.eq(writer.bad_words << 2),
+		]
 
+		armed = Signal()
+		capturing = Signal()
+		frame_ended = Signal()
+		overflow = Signal()
+		done = Signal(reset=1)
+		in_line = Signal()
+		line_bytes = Signal(16)
+		lines_sent = Signal(16) # lines the writer will finish: one per RAW10 packet that entered the FIFO
+		self.comb += [
+			sink.ready.eq(1),
+			sink.connect(fifo.sink, omit={"valid", "ready"}),
+			fifo.sink.valid.eq(sink.valid & capturing & ~overflow),
+			self.status.fields.done.eq(done),
+			self.status.fields.overflow.eq(overflow),
+		]
+
+		self.sync += [
+			If(arm,
+				armed.eq(1),
+				capturing.eq(0),
+				frame_ended.eq(0),
+				overflow.eq(0),
+				done.eq(0),
+				in_line.eq(0),
+				lines_sent.eq(0),
+				self.in_bytes.status.eq(0),
+				self.cycles.status.eq(0),
+			).Else(
+				If(sink.valid & sink.first & (sink.data_type == 0x00) & armed, # frame start
+					armed.eq(0),
+					capturing.eq(1),
+				),
+				If(capturing & ~overflow & sink.valid,
+					If(~fifo.sink.ready | writer.full,
+						overflow.eq(1),
+						# nothing follows to close the line in progress, so it never reaches the writer
+						If(in_line, lines_sent.eq(lines_sent - 1))
+					).Elif(sink.first,
+						in_line.eq(sink.data_type == 0x2B),
+						If(sink.data_type == 0x2B, lines_sent.eq(lines_sent + 1)),
+						line_bytes.eq(sink.word_count),
+						If(sink.data_type == 0x01, # frame end
+							capturing.eq(0),
+							frame_ended.eq(1)
+						)
+					).Elif(in_line & sink.last,
+						in_line.eq(0),
+						self.in_bytes.status.eq(self.in_bytes.status + line_bytes)
+					)
+				),
+				If(capturing | frame_ended | overflow,
+					If(~done, self.cycles.status.eq(self.cycles.status + 1)),
+					If((frame_ended | overflow) & ((writer.lines == lines_sent) | writer.full),
+						done.eq(1),
+						capturing.eq(0),
+						frame_ended.eq(0)
+					)
 				)
+			)
+		]
+
+# Preview pyramid ------------------------------------------------------------------------------------
+
+class PyramidSampler(Module):
+	# Sample positions for a pyramid level: every step_x-th Bayer quad of every step_y-th quad row, as `index`
+	# (quad number in the output, at output column x and row y) with `hit` set for pairs that fall inside
+	# width x height and max_quads. For box filters, every pair is also placed in its step_x x step_y cell:
+	# cell_x/y and cell_index for the output quad the cell belongs to, `inside` if that quad is in the output,
+	# and flags for the first and last column and quad row of the cell. Geometry is taken at frame start
+	def __init__(self, pair, odd_line, frame_start, step_x, step_y, width, height, max_quads):
+		self.hit = hit = Signal()
+		self.index = Signal(32)
+		self.x = Signal(16)
+		self.y = Signal(16)
+		self.cell_x = Signal(16)
+		self.cell_index = Signal(32)
+		self.inside = Signal()
+		self.first_col = Signal()
+		self.last_col = Signal()
+		self.first_row = Signal()
+		self.last_row = Signal()
+
+		step_x_l = Signal(16)
+		step_y_l = Signal(16)
+		width_l = Signal(16)
+		height_l = Signal(16)
+		col_ctr = Signal(16)
+		row_ctr = Signal(16)
+		out_x = Signal(16)
+		out_y = Signal(16)
+		row_base = Signal(32)
+
+		# position of the current pair; a new quad row starts with each even line
+		advance = Signal()
+		cur_col = Signal(16)
+		cur_x = Signal(16)
+		cur_row = Signal(16)
+		cur_y = Signal(16)
+		cur_base = Signal(32)
+		self.comb += [
+			advance.eq(pair.first & ~odd_line & (row_ctr >= step_y_l - 1)),
+			cur_col.eq(Mux(pair.first, 0, col_ctr)),
+			cur_x.eq(Mux(pair.first, 0, out_x)),
+			If(pair.first & ~odd_line,
+				cur_row.eq(Mux(advance, 0, row_ctr + 1))
+			).Else(
+				cur_row.eq(row_ctr)
 			),
-			port.adr.eq(out_y * out_width + out_x),
-			port.we.eq(is_pixels & x_hit & y_hit & (out_y < out_height) & (out_x < out_width)),
-			port.dat_w.eq(data[0:16]) # we aren't doing any RAW10 decoding; assume subsample_x is a multiple of 5
+			cur_y.eq(Mux(advance, out_y + 1, out_y)),
+			cur_base.eq(Mux(advance & (out_y != 0xFFFF), row_base + width_l, row_base)),
+			self.index.eq(cur_base + cur_x),
+			self.x.eq(cur_x),
+			self.y.eq(cur_y),
+			hit.eq(pair.valid & ~pair.error & (cur_col == 0) & (cur_row == 0) & (cur_x < width_l) & (cur_y < height_l) &
+				(self.index < max_quads)),
+			# out_x has already moved on after the first pair of a cell
+			self.cell_x.eq(Mux(cur_col == 0, cur_x, cur_x - 1)),
+			self.cell_index.eq(cur_base + self.cell_x),
+			self.inside.eq((self.cell_x < width_l) & (cur_y < height_l) & (self.cell_index < max_quads)),
+			self.first_col.eq(cur_col == 0),
+			self.last_col.eq(cur_col >= step_x_l - 1),
+			self.first_row.eq(cur_row == 0),
+			self.last_row.eq(cur_row >= step_y_l - 1),
+		]
+		self.sync += [
+			If(frame_start,
+				step_x_l.eq(step_x),
+				step_y_l.eq(step_y),
+				width_l.eq(width),
+				height_l.eq(height),
+				# so that the first even line advances to row 0
+				row_ctr.eq(step_y - 1),
+				out_y.eq(0xFFFF),
+				row_base.eq(0),
+			).Elif(pair.valid,
+				col_ctr.eq(Mux(cur_col >= step_x_l - 1, 0, cur_col + 1)),
+				out_x.eq(Mux(cur_col == 0, cur_x + 1, cur_x)),
+				row_ctr.eq(cur_row),
+				out_y.eq(cur_y),
+				row_base.eq(cur_base),
+			)
+		]
+
+class PyramidLevel(Module, AutoCSR):
+	# One downscaled output, stored as one 32-bit word per sampled quad with R and Gr (8-bit) from the even line
+	# in the low half, Gb and B from the odd line in the high half. If double buffered, banks swap at frame end
+	# and bank `front` holds the last complete frame; while `hold` is set the swap is skipped, so the front bank
+	# stays stable (and safe to cache) for as long as a reader needs it. A single buffered level finishes the
+	# frame it is writing when hold is set and skips the following ones until it is cleared; `held` tells when
+	# the memory holds one whole frame and stays put. Half the block RAM, at the cost of up to a frame of wait
+	def __init__(self, max_width, max_height, step_x, step_y, double_buffer=True):
+		self.step_x = CSRStorage(16, reset=step_x, description="Quads between samples")
+		self.step_y = CSRStorage(16, reset=step_y, description="Quad rows between samples")
+		self.width = CSRStorage(16, reset=max_width, description="Output width in quads")
+		self.height = CSRStorage(16, reset=max_height, description="Output height in quads")
+		self.front = CSRStatus(description="Bank holding the last complete frame")
+		self.frame = CSRStatus(32, description="Incremented each time the front bank changes")
+		self.hold = CSRStorage(description="Keep the front bank: set before reading it, clear when done")
+		self.held = CSRStatus(description="The front bank is kept, wait for it before reading")
+
+		# driven by PyramidCapture
+		self.pair = pair = stream.Endpoint(pixel_pair_description())
+		self.odd_line = Signal()
+		self.frame_start = Signal()
+		self.frame_end = Signal()
+
+		self.bank_size = bank_size = max_width * max_height
+		self.specials.mem = Memory(32, (2 if double_buffer else 1) * bank_size)
+		port = self.mem.get_port(write_capable=True, we_granularity=16)
+		self.specials += port
+
+		self.submodules.sampler = sampler = PyramidSampler(pair, self.odd_line, self.frame_start,
+			self.step_x.storage, self.step_y.storage, self.width.storage, self.height.storage, bank_size)
+
+		back = Signal()
+		written = Signal()
+		hold = self.hold.storage
+		writable = Signal(reset=1)
+		self.comb += self.front.status.eq(~back if double_buffer else 0)
+		if double_buffer:
+			self.comb += [
+				writable.eq(1),
+				self.held.status.eq(hold),
+			]
+		else:
+			# the frame being written is let through whole, even if hold is set on the way
+			self.comb += self.held.status.eq(hold & ~writable)
+			self.sync += If(self.frame_start, writable.eq(~hold)).Elif(self.frame_end & hold, writable.eq(0))
+		self.sync += [
+			port.we.eq(0),
+			If(self.frame_end,
+				If(written & (~hold if double_buffer else 1),
+					back.eq(~back if double_buffer else 0),
+					written.eq(0),
+					self.frame.status.eq(self.frame.status + 1)
+				)
+			).Elif(sampler.hit & writable,
+				port.we.eq(Mux(self.odd_line, 0b10, 0b01)),
+				written.eq(1)
+			),
+			port.adr.eq(Mux(back, bank_size, 0) + sampler.index),
+			port.dat_w.eq(Replicate(Cat(pair.p0[2:10], pair.p1[2:10]), 2)),
+		]
+
+class FrameAccumulator(Module, AutoCSR):
+	# Temporal accumulation at pyramid resolution, hooked into PyramidCapture like a level. Each sampled quad has
+	# two 32-bit words, R/Gr at 2 * index and Gb/B at 2 * index + 1, 16 bits per channel, updated by a
+	# read-modify-write as the pixels arrive. Mode 0 sums 10-bit pixels over `frames` frames (up to 64) then stops;
+	# mode 1 keeps an exponential moving average with 6 fraction bits, acc += (pixel << 6 - acc) >> decay.
+	# Accumulation starts at the frame after start. Read back through index/value
+	def __init__(self, max_width, max_height, step_x, step_y):
+		self.control = CSRStorage(fields=[
+			CSRField("start", size=1, offset=0, pulse=True, description="Restart accumulation at the next frame"),
+			CSRField("mode", size=1, offset=1, description="0: sum of `frames` frames, 1: moving average"),
+			CSRField("stop", size=1, offset=2, pulse=True),
+		])
+		self.frames = CSRStorage(8, reset=16, description="Frames to sum in mode 0")
+		self.decay = CSRStorage(3, reset=3, description="Moving average weight of a new frame is 2^-decay")
+		self.step_x = CSRStorage(16, reset=step_x, description="Quads between samples")
+		self.step_y = CSRStorage(16, reset=step_y, description="Quad rows between samples")
+		self.width = CSRStorage(16, reset=max_width, description="Output width in quads")
+		self.height = CSRStorage(16, reset=max_height, description="Output height in quads")
+		self.status = CSRStatus(fields=[
+			CSRField("running", size=1, offset=0),
+			CSRField("done", size=1, offset=1, description="Mode 0 sum complete"),
+			CSRField("mode", size=1, offset=2, description="Mode of the current or last accumulation"),
+			CSRField("count", size=16, offset=16, description="Frames accumulated"),
+		])
+		self.index = CSRStorage(16, description="Word to read back")
+		self.value = CSRStatus(32)
+
+		# driven by PyramidCapture
+		self.pair = pair = stream.Endpoint(pixel_pair_description())
+		self.odd_line = Signal()
+		self.frame_start = Signal()
+		self.frame_end = Signal()
+
+		max_quads = max_width * max_height
+		self.specials.mem = Memory(32, 2 * max_quads)
+		rd_port = self.mem.get_port()
+		wr_port = self.mem.get_port(write_capable=True)
+		self.specials += rd_port, wr_port
+
+		self.submodules.sampler = sampler = PyramidSampler(pair, self.odd_line, self.frame_start,
+			self.step_x.storage, self.step_y.storage, self.width.storage, self.height.storage, max_quads)
+
+		pending = Signal()
+		running = Signal()
+		done = Signal()
+		first = Signal()
+		mode = Signal()
+		decay = Signal(3)
+		count = Signal(16)
+		self.comb += [
+			self.status.fields.running.eq(running),
+			self.status.fields.done.eq(done),
+			self.status.fields.mode.eq(mode),
+			self.status.fields.count.eq(count),
+		]
+		self.sync += [
+			If(self.control.fields.start,
+				pending.eq(1),
+				running.eq(0),
+				done.eq(0),
+				count.eq(0)
+			).Elif(self.control.fields.stop,
+				pending.eq(0),
+				running.eq(0)
+			).Elif(self.frame_start & pending,
+				pending.eq(0),
+				running.eq(1),
+				first.eq(1),
+				mode.eq(self.control.fields.mode),
+				decay.eq(self.decay.storage)
+			).Elif(self.frame_end & running,
+				first.eq(0),
+				count.eq(count + 1),
+				If(~mode & (count + 1 >= self.frames.storage),
+					running.eq(0),
+					done.eq(1)
+				)
+			)
+		]
+
+		# read-modify-write: read at the sample, write back the cycle after. Each word is touched once per
+		# frame, so back to back samples never collide. The CPU reads through the same port in between
+		update = Signal()
+		s1_valid = Signal()
+		s1_adr = Signal(32)
+		s1_pix = [Signal(10) for i in range(2)]
+		cpu_read = Signal()
+		self.comb += [
+			update.eq(sampler.hit & running),
+			rd_port.adr.eq(Mux(update, Cat(self.odd_line, sampler.index), self.index.storage)),
+		]
+		self.sync += [
+			s1_valid.eq(update),
+			s1_adr.eq(Cat(self.odd_line, sampler.index)),
+			s1_pix[0].eq(pair.p0),
+			s1_pix[1].eq(pair.p1),
+			cpu_read.eq(~update),
+			If(cpu_read, self.value.status.eq(rd_port.dat_r)),
+		]
+
+		new = Signal(32)
+		for i in range(2):
+			acc = rd_port.dat_r[16*i:16*(i+1)]
+			pix = s1_pix[i]
+			diff = Signal((17, True))
+			self.comb += [
+				diff.eq(Cat(C(0, 6), pix) - acc),
+				If(first,
+					new[16*i:16*(i+1)].eq(Mux(mode, Cat(C(0, 6), pix), pix))
+				).Elif(mode,
+					new[16*i:16*(i+1)].eq(acc + (diff >> decay))
+				).Else(
+					new[16*i:16*(i+1)].eq(acc + pix)
+				)
+			]
+		self.comb += [
+			wr_port.adr.eq(s1_adr),
+			wr_port.dat_w.eq(new),
+			wr_port.we.eq(s1_valid),
+		]
+
+class ChangeMap(Module, AutoCSR):
+	# Per tile change detection at pyramid resolution, hooked into PyramidCapture like a level. Each output quad
+	# is the box sum of all pixels in its step_x x step_y cell, shifted down to 8 bits, so every pixel of a tile
+	# counts. It is compared against a per quad reference: the absolute differences are summed over tiles of
+	# tile x tile quads, and a tile whose sum exceeds `threshold` is marked changed: one bitmap word per tile
+	# row, bit n for tile column n. At frame end the bitmap bank swaps and `changed` and `frame` update; if any
+	# tile changed, `event` pulses. The cells of the current tile row are kept aside, and once the row is decided
+	# the cells of its changed tiles become their new reference; so the reference follows what was last reported
+	# and slow changes add up until they cross the threshold. The first frame after reset or a geometry change is
+	# compared against stale data
+	def __init__(self, max_width, max_height, step_x, step_y, tile=8):
+		assert tile & (tile - 1) == 0
+		max_tiles_x = (max_width + tile - 1) // tile
+		max_tiles_y = (max_height + tile - 1) // tile
+		assert max_tiles_x <= 32
+
+		self.step_x = CSRStorage(16, reset=step_x, description="Quads between samples")
+		self.step_y = CSRStorage(16, reset=step_y, description="Quad rows between samples")
+		self.width = CSRStorage(16, reset=max_width, description="Output width in quads")
+		self.height = CSRStorage(16, reset=max_height, description="Output height in quads")
+		# 4 * step_x * step_y pixels of up to 10 bits per cell
+		self.shift = CSRStorage(5, reset=bits_for(16 * step_x * step_y - 1),
+			description="Right shift from a cell's pixel sum to its 8-bit value, at least log2(16 * step_x * step_y)")
+		self.threshold = CSRStorage(16, reset=tile * tile * 4,
+			description="Sum of absolute differences above which a tile is changed (8-bit cell value units)")
+		self.changed = CSRStatus(16, description="Changed tiles in the last complete frame")
+		self.frame = CSRStatus(32, description="Incremented each time the bitmap bank changes")
+		self.row = CSRStorage(8, description="Tile row to read back from the last complete frame")
+		self.bitmap = CSRStatus(32, description="Changed tiles of that row, bit n for tile column n")
+
+		# driven by PyramidCapture
+		self.pair = pair = stream.Endpoint(pixel_pair_description())
+		self.odd_line = Signal()
+		self.frame_start = Signal()
+		self.frame_end = Signal()
+		# collected by PyramidCapture into its interrupt
+		self.event = Signal()
+
+		max_quads = max_width * max_height
+		self.specials.mem = Memory(8, max_quads)
+		rd_port = self.mem.get_port()
+		wr_port = self.mem.get_port(write_capable=True)
+		self.specials += rd_port, wr_port
+		# column sums of the cells of the current cell row
+		self.specials.column_mem = Memory(24, max_width)
+		col_rd = self.column_mem.get_port()
+		col_wr = self.column_mem.get_port(write_capable=True)
+		self.specials += col_rd, col_wr
+		# cells of the current and the last tile row: value, reference address and tile row, one bank each
+		row_cells = tile * max_width
+		adr_bits = bits_for(max_quads)
+		self.specials.row_mem = Memory(8 + adr_bits + 8, 2 * row_cells)
+		row_wr = self.row_mem.get_port(write_capable=True)
+		row_rd = self.row_mem.get_port()
+		self.specials += row_wr, row_rd
+		self.specials.bitmap_mem = Memory(32, 2 * max_tiles_y)
+		bitmap_wr = self.bitmap_mem.get_port(write_capable=True)
+		bitmap_rd = self.bitmap_mem.get_port(async_read=True)
+		self.specials += bitmap_wr, bitmap_rd
+
+		self.submodules.sampler = sampler = PyramidSampler(pair, self.odd_line, self.frame_start,
+			self.step_x.storage, self.step_y.storage, self.width.storage, self.height.storage, max_quads)
+
+		shift = log2_int(tile)
+		back = Signal()
+
+		# sum of the pairs of the current cell on this line; at the cell's last column it is added to the
+		# column sum, read here and written back the cycle after. The last line of the cell row gives the cell.
+		# Widths allow cells up to 32 x 32 quads
+		line_sum = Signal(16)
+		pair_sum = Signal(16)
+		b1_valid = Signal()
+		b1_first = Signal()
+		b1_last = Signal()
+		b1_x = Signal(16)
+		b1_y = Signal(16)
+		b1_index = Signal(32)
+		b1_sum = Signal(16)
+		self.comb += [
+			pair_sum.eq(Mux(sampler.first_col, 0, line_sum) + pair.p0 + pair.p1),
+			col_rd.adr.eq(sampler.cell_x),
+		]
+		self.sync += [
+			If(pair.valid, line_sum.eq(pair_sum)),
+			b1_valid.eq(pair.valid & ~pair.error & sampler.inside & sampler.last_col),
+			b1_first.eq(sampler.first_row & ~self.odd_line),
+			b1_last.eq(sampler.last_row & self.odd_line),
+			b1_x.eq(sampler.cell_x),
+			b1_y.eq(sampler.y),
+			b1_index.eq(sampler.cell_index),
+			b1_sum.eq(pair_sum),
+		]
+		column_sum = Signal(24)
+		cell_value = Signal(24)
+		self.comb += [
+			column_sum.eq(Mux(b1_first, 0, col_rd.dat_r) + b1_sum),
+			cell_value.eq(column_sum >> self.shift.storage),
+			col_wr.adr.eq(b1_x),
+			col_wr.dat_w.eq(column_sum),
+			col_wr.we.eq(b1_valid & ~b1_last),
+		]
+
+		# reference read for the cell and compared the cycle after; the cell is also put aside in row_mem
+		s1_valid = Signal()
+		s1_adr = Signal(32)
+		s1_value = Signal(8)
+		s1_x = Signal(16)
+		s1_y = Signal(16)
+		s1_tile_x = Signal(max=max(max_tiles_x, 2))
+		s1_tile_y = Signal(8)
+		self.comb += rd_port.adr.eq(b1_index)
+		self.sync += [
+			s1_valid.eq(b1_valid & b1_last),
+			s1_adr.eq(b1_index),
+			s1_value.eq(Mux(cell_value > 255, 255, cell_value)),
+			s1_x.eq(b1_x),
+			s1_y.eq(b1_y),
+			s1_tile_x.eq(b1_x >> shift),
+			s1_tile_y.eq(b1_y >> shift),
+		]
+		old = Signal(8)
+		sad = Signal(8)
+		self.comb += [
+			old.eq(rd_port.dat_r),
+			sad.eq(Mux(s1_value > old, s1_value - old, old - s1_value)),
+			row_wr.adr.eq(Mux(s1_tile_y[0], row_cells, 0) + s1_y[:shift] * max_width + s1_x),
+			row_wr.dat_w.eq(Cat(s1_value, s1_adr[:adr_bits], s1_tile_y)),
+			row_wr.we.eq(s1_valid),
+		]
+
+		# tile sums for the current tile row, decided when the next tile row starts or the frame ends
+		acc = Array(Signal(bits_for(tile * tile * 255)) for i in range(max_tiles_x))
+		tile_y = Signal(8)
+		dirty = Signal()
+		count = Signal(16)
+		row_bits = Signal(max_tiles_x)
+		row_count = Signal(16)
+		new_row = Signal()
+		frame_end_b1 = Signal()
+		frame_end_d = Signal()
+		frame_start_b1 = Signal()
+		frame_start_d = Signal()
+		total = Signal(16)
+		decide = Signal()
+		self.comb += [
+			row_bits.eq(Cat(*[a > self.threshold.storage for a in acc])),
+			row_count.eq(sum(row_bits[i] for i in range(max_tiles_x))),
+			new_row.eq(s1_valid & (s1_tile_y != tile_y)),
+			decide.eq(dirty & (new_row | frame_end_d)),
+			total.eq(count + Mux(dirty, row_count, 0)),
+			bitmap_wr.adr.eq(Mux(back, max_tiles_y, 0) + tile_y),
+			bitmap_wr.dat_w.eq(row_bits),
+			bitmap_wr.we.eq(decide),
+			bitmap_rd.adr.eq(Mux(back, 0, max_tiles_y) + self.row.storage),
+			self.bitmap.status.eq(bitmap_rd.dat_r),
+		]
+		self.sync += [
+			# lined up with the cells, two stages behind the pairs
+			frame_end_b1.eq(self.frame_end),
+			frame_end_d.eq(frame_end_b1),
+			frame_start_b1.eq(self.frame_start),
+			frame_start_d.eq(frame_start_b1),
+			self.event.eq(0),
+			# a frame start may directly follow the frame end, so the end is handled first
+			If(frame_end_d & dirty,
+				back.eq(~back),
+				self.changed.status.eq(total),
+				self.frame.status.eq(self.frame.status + 1),
+				self.event.eq(total != 0),
+				tile_y.eq(0),
+				dirty.eq(0),
+				count.eq(0),
+				[a.eq(0) for a in acc]
+			).Elif(frame_start_d,
+				tile_y.eq(0),
+				dirty.eq(0),
+				count.eq(0),
+				[a.eq(0) for a in acc]
+			).Elif(new_row,
+				If(dirty, count.eq(count + row_count)),
+				tile_y.eq(s1_tile_y),
+				[acc[i].eq(Mux(s1_tile_x == i, sad, 0)) for i in range(max_tiles_x)],
+				dirty.eq(1)
+			).Elif(s1_valid,
+				acc[s1_tile_x].eq(acc[s1_tile_x] + sad),
+				dirty.eq(1)
+			)
+		]
+
+		# once a tile row is decided, its cells in changed tiles are copied to the reference. This takes
+		# tile * max_width cycles, well within the tile rows of lines before the next decision
+		copying = Signal()
+		copy_bits = Signal(max_tiles_x)
+		copy_tile_y = Signal(8)
+		copy_r = Signal(max=max(tile, 2))
+		copy_x = Signal(max=max(max_width, 2))
+		c1_valid = Signal()
+		c1_tile_x = Signal(max=max(max_tiles_x, 2))
+		self.comb += [
+			row_rd.adr.eq(Mux(copy_tile_y[0], row_cells, 0) + copy_r * max_width + copy_x),
+			wr_port.adr.eq(row_rd.dat_r[8:8+adr_bits]),
+			wr_port.dat_w.eq(row_rd.dat_r[0:8]),
+			# cells not seen in this tile row are left alone
+			wr_port.we.eq(c1_valid & (row_rd.dat_r[8+adr_bits:] == copy_tile_y) &
+				Array(copy_bits[i] for i in range(max_tiles_x))[c1_tile_x]),
+		]
+		self.sync += [
+			c1_valid.eq(copying),
+			c1_tile_x.eq(copy_x >> shift),
+			If(decide,
+				copying.eq(1),
+				copy_bits.eq(row_bits),
+				copy_tile_y.eq(tile_y),
+				copy_r.eq(0),
+				copy_x.eq(0)
+			).Elif(copying,
+				If(copy_x == max_width - 1,
+					copy_x.eq(0),
+					If(copy_r == tile - 1,
+						copying.eq(0)
+					).Else(
+						copy_r.eq(copy_r + 1)
+					)
+				).Else(
+					copy_x.eq(copy_x + 1)
+				)
+			)
+		]
+
+class PyramidCapture(Module, AutoCSR):
+	# Several downscaled previews from one pass over the RAW10 stream. levels is a list of (name, PyramidLevel);
+	# each level has its own memory (level.mem) and CSRs. Levels with an `event` output get an interrupt
+	# source of the same name in `ev`. Never back-pressures the CSI stream: if the FIFO fills, the rest of the
+	# line is dropped, so the unpacker closes it as cut short and no pixel lands in the wrong place
+	def __init__(self, levels, data_width=32, fifo_depth=256):
+		self.sink = sink = stream.Endpoint(csi_packet_description(data_width))
+		self.drops = CSRStatus(32, description="Beats dropped because the unpacker fell behind, up to the end of their line")
+		self.last_line_count = Signal(16)
+
+		self.submodules.fifo = fifo = stream.SyncFIFO(csi_packet_description(data_width), fifo_depth, buffered=True)
+		self.submodules.unpacker = unpacker = RAW10Unpacker(data_width)
+		dropping = Signal()
+		room = Signal()
+		self.comb += [
+			sink.ready.eq(1),
+			# payload leaves the last entry free, so the header after a drop still gets in
+			room.eq(fifo.sink.ready & (sink.first | (fifo.level < fifo_depth - 1))),
+			sink.connect(fifo.sink, omit={"valid", "ready"}),
+			fifo.sink.valid.eq(sink.valid & room & (sink.first | ~dropping)),
+			fifo.source.connect(unpacker.sink),
+			unpacker.source.ready.eq(1),
+		]
+		self.sync += [
+			If(sink.valid & (sink.first | ~dropping), dropping.eq(~room)),
+			If(sink.valid & ~fifo.sink.valid, self.drops.status.eq(self.drops.status + 1)),
+		]
+
+		# frame start/end are seen after the unpacker has emitted the last line before them
+		frame_start = Signal()
+		frame_end = Signal()
+		odd_line = Signal()
+		line_count = Signal(16)
+		pair = unpacker.source
+		self.comb += [
+			frame_start.eq(fifo.source.valid & fifo.source.ready & fifo.source.first & (fifo.source.data_type == 0x00)),
+			frame_end.eq(fifo.source.valid & fifo.source.ready & fifo.source.first & (fifo.source.data_type == 0x01)),
+		]
+		self.sync += [
+			If(frame_start,
+				odd_line.eq(1),
+				line_count.eq(0),
+				self.last_line_count.eq(line_count)
+			).Elif(pair.valid & pair.first,
+				odd_line.eq(~odd_line),
+				line_count.eq(line_count + 1)
+			)
+		]
+
+		self.levels = []
+		for name, level in levels:
+			setattr(self.submodules, name, level)
+			self.levels.append(level)
+			self.comb += [
+				pair.connect(level.pair, omit={"ready"}),
+				level.frame_start.eq(frame_start),
+				level.frame_end.eq(frame_end),
+				# parity of the line the current pair belongs to
+				level.odd_line.eq(Mux(pair.first, ~odd_line, odd_line)),
+			]
+
+		events = [(name, level) for name, level in levels if hasattr(level, "event")]
+		if events:
+			self.submodules.ev = EventManager()
+			for name, level in events:
+				setattr(self.ev, name, EventSourcePulse())
+			self.ev.finalize()
+			self.comb += [getattr(self.ev, name).trigger.eq(level.event) for name, level in events]
+
+# Snapshot mode --------------------------------------------------------------------------------------
+
+class SnapshotControl(Module, AutoCSR):
+	# Keeps the D-PHY powered down between snapshots. A snap pulse or a rising edge on `trigger` powers it up
+	# and raises the `wake` event (the interrupt handler flags it and the main loop wakes the sensor), then
+	# the first valid frame (complete, no FIFO overflow, `lines` RAW10 lines if set) ends the snapshot, powers
+	# it down again and raises `sleep`. Latencies are measured from the trigger in sys clock cycles. With enable clear
+	# the D-PHY is always on
+	def __init__(self, overflows, data_width=32):
+		self.sink = sink = stream.Endpoint(csi_packet_description(data_width))
+		self.trigger = Signal()
+		self.pd_dphy = Signal()
+		self.hs_rx_en = Signal()
+
+		self.control = CSRStorage(fields=[
+			CSRField("enable", size=1, offset=0, description="Snapshot mode: D-PHY powered down while idle"),
+			CSRField("snap", size=1, offset=1, pulse=True, description="Take a snapshot"),
+			CSRField("hw_trigger", size=1, offset=2, description="Also take a snapshot on a rising edge of the trigger input"),
+		])
+		self.lines = CSRStorage(16, description="RAW10 lines in a valid frame, 0 to accept any complete frame")
+		self.status = CSRStatus(fields=[
+			CSRField("busy", size=1, offset=0, description="Waiting for a valid frame"),
+			CSRField("done", size=1, offset=1, description="A snapshot has completed since the last trigger"),
+		])
+		self.latency_start = CSRStatus(32, description="Trigger to first frame start")
+		self.latency_frame = CSRStatus(32, description="Trigger to end of the first valid frame")
+		self.skipped = CSRStatus(16, description="Frames rejected before the valid one")
+
+		enable = self.control.fields.enable
+		trigger = Signal()
+		trigger_d = Signal()
+		self.specials += MultiReg(self.trigger, trigger)
+		self.sync += trigger_d.eq(trigger)
+
+		busy = Signal()
+		busy_d = Signal()
+		done = Signal()
+		cycles = Signal(32)
+		seen_start = Signal()
+		in_frame = Signal()
+		line_count = Signal(16)
+		frame_overflows = Signal(32)
+		start = Signal()
+		self.comb += [
+			sink.ready.eq(1),
+			start.eq(enable & ~busy & (self.control.fields.snap |
+				(self.control.fields.hw_trigger & trigger & ~trigger_d))),
+			self.pd_dphy.eq(enable & ~busy),
+			self.hs_rx_en.eq(~enable | busy),
+			self.status.fields.busy.eq(busy),
+			self.status.fields.done.eq(done),
+		]
+
+		self.submodules.ev = EventManager()
+		self.ev.wake = EventSourcePulse()
+		self.ev.sleep = EventSourcePulse()
+		self.ev.finalize()
+		self.comb += [
+			self.ev.wake.trigger.eq(start),
+			self.ev.sleep.trigger.eq(busy_d & ~busy),
+		]
+
+		self.sync += [
+			busy_d.eq(busy),
+			If(~enable,
+				busy.eq(0)
+			).Elif(start,
+				busy.eq(1),
+				done.eq(0),
+				cycles.eq(0),
+				seen_start.eq(0),
+				in_frame.eq(0),
+				self.latency_start.status.eq(0),
+				self.latency_frame.status.eq(0),
+				self.skipped.status.eq(0),
+			).Elif(busy,
+				cycles.eq(cycles + 1),
+				If(sink.valid & sink.first,
+					If(sink.data_type == 0x00, # frame start
+						If(~seen_start, self.latency_start.status.eq(cycles)),
+						seen_start.eq(1),
+						in_frame.eq(1),
+						line_count.eq(0),
+						frame_overflows.eq(overflows)
+					).Elif(sink.data_type == 0x2B,
+						line_count.eq(line_count + 1)
+					).Elif((sink.data_type == 0x01) & in_frame, # frame end
+						in_frame.eq(0),
+						If((overflows == frame_overflows) & ((self.lines.storage == 0) | (line_count == self.lines.storage)),
+							self.latency_frame.status.eq(cycles),
+							busy.eq(0),
+							done.eq(1)
+						).Else(
+							self.skipped.status.eq(self.skipped.status + 1)
+						)
+					)
+				)
+			)
 		]
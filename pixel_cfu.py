@@ -0,0 +1,73 @@
+# Pixel custom function unit for the VexRiscv CFU port (cpu variant full+cfu), generated as the Verilog
+# module Cfu that LiteX instantiates. Instructions use the custom-0 opcode, R-type, selected by funct3;
+# software/pixel.h has the matching intrinsics and C fallbacks.
+#
+#   funct3 0  rgb565   rd = RGB565 of the Bayer quad word rs1 (R[7:0], Gr[15:8], Gb[23:16], B[31:24]), green from Gr
+#   funct3 1  extract  rd = byte rs2[1:0] of rs1
+#   funct3 2  addsat   rd = per byte min(rs1 + rs2, 255)
+#   funct3 3  avg      rd = per byte (rs1 + rs2 + 1) >> 1
+
+import os
+
+from migen import *
+from migen.fhdl import verilog
+
+PIX_RGB565  = 0
+PIX_EXTRACT = 1
+PIX_ADDSAT  = 2
+PIX_AVG     = 3
+
+class PixelCFU(Module):
+    def __init__(self):
+        self.cmd_valid = Signal(name="cmd_valid")
+        self.cmd_ready = Signal(name="cmd_ready")
+        self.function_id = Signal(10, name="cmd_payload_function_id")
+        self.inputs_0 = Signal(32, name="cmd_payload_inputs_0")
+        self.inputs_1 = Signal(32, name="cmd_payload_inputs_1")
+        self.rsp_valid = Signal(name="rsp_valid")
+        self.rsp_ready = Signal(name="rsp_ready")
+        self.outputs_0 = Signal(32, name="rsp_payload_outputs_0")
+        # unused, but part of the interface LiteX connects
+        self.clk = Signal(name="clk")
+        self.reset = Signal(name="reset")
+
+        a = self.inputs_0
+        b = self.inputs_1
+        funct3 = self.function_id[0:3]
+
+        rgb565 = Signal(32)
+        self.comb += rgb565.eq(Cat(a[27:32], a[10:16], a[3:8]))
+
+        extract = Signal(32)
+        self.comb += Case(b[0:2], {i: extract.eq(a[8*i:8*(i+1)]) for i in range(4)})
+
+        addsat = Signal(32)
+        avg = Signal(32)
+        for i in range(4):
+            total = Signal(9)
+            self.comb += [
+                total.eq(a[8*i:8*(i+1)] + b[8*i:8*(i+1)]),
+                addsat[8*i:8*(i+1)].eq(Mux(total[8], 0xFF, total[0:8])),
+                avg[8*i:8*(i+1)].eq((total + 1) >> 1),
+            ]
+
+        # single cycle: the response is valid as soon as the command is
+        self.comb += [
+            self.rsp_valid.eq(self.cmd_valid),
+            self.cmd_ready.eq(self.rsp_ready),
+            Case(funct3, {
+                PIX_RGB565:  self.outputs_0.eq(rgb565),
+                PIX_EXTRACT: self.outputs_0.eq(extract),
+                PIX_ADDSAT:  self.outputs_0.eq(addsat),
+                PIX_AVG:     self.outputs_0.eq(avg),
+                "default":   self.outputs_0.eq(0),
+            }),
+        ]
+
+def generate(filename):
+    cfu = PixelCFU()
+    ios = {cfu.cmd_valid, cfu.cmd_ready, cfu.function_id, cfu.inputs_0, cfu.inputs_1,
+           cfu.rsp_valid, cfu.rsp_ready, cfu.outputs_0, cfu.clk, cfu.reset}
+    os.makedirs(os.path.dirname(os.path.abspath(filename)), exist_ok=True)
+    verilog.convert(cfu, ios=ios, name="Cfu").write(filename)
+    return filename
@@ -0,0 +1,620 @@
+# Behavioural models used to run the whole SoC under Verilator (crosslink_nx_vip.py --sim)
+
+import os
+import re
+import sys
+import time
+import subprocess
+
+from migen import *
+from migen.genlib.cdc import MultiReg, PulseSynchronizer
+
+from litex.build.generic_platform import *
+from litex.build.sim import SimPlatform
+from litex.soc.interconnect import wishbone
+from litex.soc.interconnect.csr import *
+
+from dphy_wrapper import lmmi_layout, LMMIMaster
+from mipi_csi import PyramidCapture, ChangeMap
+
+_io = [
+    ("sys_clk", 0, Pins(1)),
+    ("sys_rst", 0, Pins(1)),
+    ("mipi_clk", 0, Pins(1)),
+    ("serial", 0,
+        Subsignal("source_valid", Pins(1)),
+        Subsignal("source_ready", Pins(1)),
+        Subsignal("source_data",  Pins(8)),
+        Subsignal("sink_valid",   Pins(1)),
+        Subsignal("sink_ready",   Pins(1)),
+        Subsignal("sink_data",    Pins(8)),
+    ),
+    ("user_led", 0, Pins(1)),
+    ("user_led", 1, Pins(1)),
+    ("user_led", 2, Pins(1)),
+    ("user_led", 3, Pins(1)),
+    ("lcd_spi", 0,
+        Subsignal("clk",  Pins(1)),
+        Subsignal("mosi", Pins(1)),
+        Subsignal("miso", Pins(1)),
+        Subsignal("cs_n", Pins(1)),
+    ),
+    ("lcd_gpio", 0, Pins(2)),
+]
+
+class Platform(SimPlatform):
+    def __init__(self):
+        SimPlatform.__init__(self, "SIM", _io)
+
+# CSI-2 frame generation ---------------------------------------------------------------------------
+
+_ecc_bits = [
+    [0, 1, 2, 4, 5, 7, 10, 11, 13, 16, 20, 21, 22, 23],
+    [0, 1, 3, 4, 6, 8, 10, 12, 14, 17, 20, 21, 22, 23],
+    [0, 2, 3, 5, 6, 9, 11, 12, 15, 18, 20, 21, 22],
+    [1, 2, 3, 7, 8, 9, 13, 14, 15, 19, 20, 21, 23],
+    [4, 5, 6, 7, 8, 9, 16, 17, 18, 19, 20, 22, 23],
+    [10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 21, 22, 23],
+]
+
+def csi_header(data_type, word_count, vc=0):
+    d = (vc << 6) | data_type | (word_count << 8)
+    ecc = 0
+    for i, bits in enumerate(_ecc_bits):
+        p = 0
+        for b in bits:
+            p ^= (d >> b) & 1
+        ecc |= p << i
+    return d | (ecc << 24)
+
+def csi_crc(data):
+    crc = 0xFFFF
+    for b in data:
+        for i in range(8):
+            if (crc ^ (b >> i)) & 1:
+                crc = (crc >> 1) ^ 0x8408
+            else:
+                crc >>= 1
+    return crc
+
+def colour_bars(width, height):
+    # 8 vertical bars on an RGGB mosaic, as RAW10 values
+    bars = [(1023, 1023, 1023), (1023, 1023, 0), (0, 1023, 1023), (0, 1023, 0),
+            (1023, 0, 1023), (1023, 0, 0), (0, 0, 1023), (0, 0, 0)]
+    pixels = []
+    for y in range(height):
+        for x in range(width):
+            r, g, b = bars[(x * 8) // width]
+            if y % 2 == 0:
+                pixels.append(r if x % 2 == 0 else g)
+            else:
+                pixels.append(g if x % 2 == 0 else b)
+    return pixels
+
+def load_raw_image(filename, width, height):
+    # Accepts 16-bit little-endian samples (low 10 bits used), 8-bit samples or CSI-2 packed RAW10,
+    # told apart by file size
+    if filename is None:
+        return colour_bars(width, height)
+    with open(filename, "rb") as f:
+        data = f.read()
+    n = width * height
+    if len(data) == 2 * n:
+        return [(data[2*i] | (data[2*i+1] << 8)) & 0x3FF for i in range(n)]
+    elif len(data) == n:
+        return [b << 2 for b in data]
+    elif len(data) == (n * 5) // 4:
+        pixels = []
+        for i in range(0, len(data), 5):
+            for j in range(4):
+                pixels.append((data[i+j] << 2) | ((data[i+4] >> (2*j)) & 0x3))
+        return pixels
+    raise ValueError("{}: size {} doesn't match a {}x{} raw image".format(filename, len(data), width, height))
+
+def pack_raw10(pixels):
+    data = bytearray()
+    for i in range(0, len(pixels), 4):
+        p = pixels[i:i+4]
+        data += bytes([v >> 2 for v in p])
+        data.append((p[0] & 3) | ((p[1] & 3) << 2) | ((p[2] & 3) << 4) | ((p[3] & 3) << 6))
+    return data
+
+def image_to_lane_words(pixels, width, height):
+    # One entry per line: the packed payload as 32-bit words (byte n on lane n % 4), then a word holding the CRC
+    if (width * 5) % 16 != 0:
+        raise ValueError("width must be a multiple of 16 so lines fill whole 4-lane words")
+    words = []
+    for y in range(height):
+        line = pack_raw10(pixels[y*width:(y+1)*width])
+        for i in range(0, len(line), 4):
+            words.append(int.from_bytes(line[i:i+4], "little"))
+        words.append(csi_crc(line))
+    return words
+
+# D-PHY model --------------------------------------------------------------------------------------
+
+class SimLMMISlave(Module):
+    # LMMI register file with the handshake of the hard D-PHY: requests are held until ready, and read data
+    # follows later with rdata_valid. Latencies are deliberately not fixed at one cycle; a read_latency of 0
+    # returns the data in the same cycle as ready
+    def __init__(self, lmmi, ready_latency=3, read_latency=2):
+        self.specials.regs = Memory(4, 32)
+        port = self.regs.get_port(write_capable=True, async_read=True)
+        self.specials += port
+
+        wait = Signal(max=max(ready_latency, read_latency) + 1)
+        self.comb += [
+            port.adr.eq(lmmi.offset),
+            port.dat_w.eq(lmmi.wdata),
+        ]
+
+        if read_latency == 0:
+            read = [
+                lmmi.rdata.eq(port.dat_r),
+                lmmi.rdata_valid.eq(1),
+                NextState("IDLE")
+            ]
+        else:
+            read = [
+                NextValue(lmmi.rdata, port.dat_r),
+                NextValue(wait, read_latency),
+                NextState("READ")
+            ]
+
+        self.submodules.fsm = fsm = FSM(reset_state="IDLE")
+        fsm.act("IDLE",
+            If(lmmi.request,
+                NextValue(wait, ready_latency),
+                NextState("ACCEPT")
+            )
+        )
+        fsm.act("ACCEPT",
+            If(wait != 0,
+                NextValue(wait, wait - 1)
+            ).Else(
+                lmmi.ready.eq(1),
+                If(lmmi.wr_rdn,
+                    port.we.eq(1),
+                    NextState("IDLE")
+                ).Else(*read)
+            )
+        )
+        fsm.act("READ",
+            If(wait != 0,
+                NextValue(wait, wait - 1)
+            ).Else(
+                lmmi.rdata_valid.eq(1),
+                NextState("IDLE")
+            )
+        )
+
+class SimDPHY(Module):
+    # Drop-in for DPHY_CSIRX_CIL that replays a stored RAW10 frame as CSI-2 byte-clock words, for as long as
+    # enable (sys domain, driven by the sensor stub's streaming bit) is set
+    def __init__(self, clk, words, width, height, line_blank=64, frame_blank=4096, num_lanes=4, gearing=8):
+        data_width = num_lanes * gearing
+        self.sync_clk = Signal()
+        self.sync_rst = Signal()
+        self.pd_dphy = Signal()
+        self.lmmi = Record(lmmi_layout)
+        self.hs_rx_en = Signal()
+        self.hs_rx_data = Signal(data_width)
+        self.hs_rx_sync = Signal(num_lanes)
+        self.clk_byte = Signal()
+        self.ready = Signal()
+        self.enable = Signal()
+        self.frame_done = Signal()
+
+        line_words = (width * 5) // 16
+        self.comb += self.clk_byte.eq(clk)
+
+        self.submodules.lmmi_slave = SimLMMISlave(self.lmmi)
+        self.comb += self.ready.eq(self.lmmi.ready)
+
+        self.specials.rom = Memory(32, len(words), init=words)
+        rom_port = self.rom.get_port(clock_domain="mipi")
+        self.specials += rom_port
+
+        enable = Signal()
+        self.specials += MultiReg(self.enable, enable, "mipi")
+        active = Signal()
+        self.comb += active.eq(enable & self.hs_rx_en & ~self.pd_dphy)
+
+        rom_adr = Signal(max=len(words) + 1)
+        line = Signal(max=height + 1)
+        word = Signal(max=line_words + 2)
+        blank = Signal(max=max(line_blank, frame_blank) + 1, reset=frame_blank)
+        self.comb += rom_port.adr.eq(rom_adr)
+
+        sync_word = Replicate(C(0xB8, 8), num_lanes)
+        self.submodules.fsm = fsm = ClockDomainsRenamer("mipi")(FSM(reset_state="FRAME_BLANK"))
+        fsm.act("FRAME_BLANK",
+            If(blank != 0,
+                NextValue(blank, blank - 1)
+            ).Elif(active,
+                NextState("FS_SYNC")
+            )
+        )
+        fsm.act("FS_SYNC",
+            self.hs_rx_sync.eq(2**num_lanes - 1),
+            self.hs_rx_data.eq(sync_word),
+            NextState("FS")
+        )
+        fsm.act("FS",
+            self.hs_rx_data.eq(csi_header(0x00, 0)),
+            NextValue(line, 0),
+            NextValue(rom_adr, 0),
+            NextValue(blank, line_blank),
+            NextState("LINE_BLANK")
+        )
+        fsm.act("LINE_BLANK",
+            If(blank != 0,
+                NextValue(blank, blank - 1)
+            ).Else(
+                NextState("LINE_SYNC")
+            )
+        )
+        fsm.act("LINE_SYNC",
+            self.hs_rx_sync.eq(2**num_lanes - 1),
+            self.hs_rx_data.eq(sync_word),
+            NextState("LINE_HDR")
+        )
+        fsm.act("LINE_HDR",
+            self.hs_rx_data.eq(csi_header(0x2B, (width * 5) // 4)),
+            NextValue(word, 0),
+            NextValue(rom_adr, rom_adr + 1),
+            NextState("LINE_DATA")
+        )
+        # the last word of each line is the CRC; by then rom_adr already points at the next line
+        fsm.act("LINE_DATA",
+            self.hs_rx_data.eq(rom_port.dat_r),
+            NextValue(word, word + 1),
+            If(word == line_words,
+                NextValue(line, line + 1),
+                NextValue(blank, line_blank),
+                If(line == height - 1,
+                    NextState("FE_SYNC")
+                ).Else(
+                    NextState("LINE_BLANK")
+                )
+            ).Else(
+                NextValue(rom_adr, rom_adr + 1)
+            )
+        )
+        fsm.act("FE_SYNC",
+            self.hs_rx_sync.eq(2**num_lanes - 1),
+            self.hs_rx_data.eq(sync_word),
+            NextState("FE")
+        )
+        fsm.act("FE",
+            self.hs_rx_data.eq(csi_header(0x01, 0)),
+            self.frame_done.eq(1),
+            NextValue(blank, frame_blank),
+            NextState("FRAME_BLANK")
+        )
+
+# I2C sensor stub ----------------------------------------------------------------------------------
+
+class SimI2CSensor(Module, AutoCSR):
+    # Same CSR interface as litex.soc.cores.bitbang.I2CMaster, with an IMX258-like register file attached to the bus.
+    # 16-bit register addresses, auto-incrementing reads and writes
+    def __init__(self, addr=0x1a, chip_id=0x0258):
+        self._w = CSRStorage(fields=[
+            CSRField("scl", size=1, offset=0),
+            CSRField("oe",  size=1, offset=1),
+            CSRField("sda", size=1, offset=2)],
+            name="w")
+        self._r = CSRStatus(fields=[
+            CSRField("sda", size=1, offset=0)],
+            name="r")
+        self.streaming = Signal()
+
+        regs_init = [0] * 65536
+        regs_init[0x0016] = chip_id >> 8
+        regs_init[0x0017] = chip_id & 0xFF
+        self.specials.regs = Memory(8, 65536, init=regs_init)
+        rd_port = self.regs.get_port(async_read=True)
+        wr_port = self.regs.get_port(write_capable=True)
+        self.specials += rd_port, wr_port
+
+        scl = Signal()
+        sda = Signal()
+        sda_out = Signal(reset=1)
+        self.comb += [
+            scl.eq(self._w.fields.scl),
+            sda.eq(Mux(self._w.fields.oe, self._w.fields.sda, 1) & sda_out),
+            self._r.fields.sda.eq(sda),
+        ]
+
+        scl_d = Signal(reset=1)
+        sda_d = Signal(reset=1)
+        self.sync += [
+            scl_d.eq(scl),
+            sda_d.eq(sda),
+        ]
+        scl_rise = Signal()
+        scl_fall = Signal()
+        start = Signal()
+        stop = Signal()
+        self.comb += [
+            scl_rise.eq(scl & ~scl_d),
+            scl_fall.eq(~scl & scl_d),
+            start.eq(scl & scl_d & sda_d & ~sda),
+            stop.eq(scl & scl_d & ~sda_d & sda),
+        ]
+
+        shreg = Signal(8)
+        bit = Signal(4)
+        byte_idx = Signal(2)
+        is_read = Signal()
+        acked = Signal()
+        reg_addr = Signal(16)
+        self.comb += [
+            rd_port.adr.eq(reg_addr),
+            wr_port.adr.eq(reg_addr),
+            wr_port.dat_w.eq(shreg),
+        ]
+
+        self.submodules.fsm = fsm = FSM(reset_state="IDLE")
+        fsm.act("IDLE",
+            NextValue(sda_out, 1),
+            If(start,
+                NextValue(bit, 0),
+                NextValue(byte_idx, 0),
+                NextState("RX")
+            )
+        )
+        fsm.act("RX",
+            If(stop,
+                NextState("IDLE")
+            ).Elif(start,
+                NextValue(bit, 0),
+                NextValue(byte_idx, 0)
+            ).Elif(scl_rise,
+                NextValue(shreg, Cat(sda, shreg[0:7])),
+                NextValue(bit, bit + 1)
+            ).Elif(scl_fall & (bit == 8),
+                If(byte_idx == 0,
+                    If(shreg[1:8] == addr,
+                        NextValue(is_read, shreg[0]),
+                        NextValue(sda_out, 0),
+                        NextState("RX_ACK")
+                    ).Else(
+                        NextState("IDLE")
+                    )
+                ).Else(
+                    If(byte_idx == 1,
+                        NextValue(reg_addr[8:16], shreg)
+                    ).Elif(byte_idx == 2,
+                        NextValue(reg_addr[0:8], shreg)
+                    ).Else(
+                        wr_port.we.eq(1),
+                        If(reg_addr == 0x0100,
+                            NextValue(self.streaming, shreg[0])
+                        ),
+                        NextValue(reg_addr, reg_addr + 1)
+                    ),
+                    NextValue(sda_out, 0),
+                    NextState("RX_ACK")
+                ),
+                If(byte_idx != 3,
+                    NextValue(byte_idx, byte_idx + 1)
+                )
+            )
+        )
+        fsm.act("RX_ACK",
+            If(scl_fall,
+                NextValue(bit, 0),
+                If(is_read,
+                    NextValue(sda_out, rd_port.dat_r[7]),
+                    NextValue(shreg, rd_port.dat_r << 1),
+                    NextValue(bit, 1),
+                    NextState("TX")
+                ).Else(
+                    NextValue(sda_out, 1),
+                    NextState("RX")
+                )
+            )
+        )
+        fsm.act("TX",
+            If(stop,
+                NextState("IDLE")
+            ).Elif(start,
+                NextValue(sda_out, 1),
+                NextValue(bit, 0),
+                NextValue(byte_idx, 0),
+                NextState("RX")
+            ).Elif(scl_fall,
+                If(bit == 8,
+                    NextValue(sda_out, 1),
+                    NextState("TX_ACK")
+                ).Else(
+                    NextValue(sda_out, shreg[7]),
+                    NextValue(shreg, shreg << 1),
+                    NextValue(bit, bit + 1)
+                )
+            )
+        )
+        fsm.act("TX_ACK",
+            If(stop,
+                NextState("IDLE")
+            ).Elif(start,
+                NextValue(bit, 0),
+                NextValue(byte_idx, 0),
+                NextState("RX")
+            ).Elif(scl_rise,
+                NextValue(acked, ~sda),
+                If(~sda,
+                    NextValue(reg_addr, reg_addr + 1)
+                )
+            ).Elif(scl_fall,
+                If(acked,
+                    NextValue(sda_out, rd_port.dat_r[7]),
+                    NextValue(shreg, rd_port.dat_r << 1),
+                    NextValue(bit, 1),
+                    NextState("TX")
+                ).Else(
+                    NextState("IDLE")
+                )
+            )
+        )
+
+# HyperRAM model -----------------------------------------------------------------------------------
+
+class SimHyperRAM(Module):
+    # Plain memory with a fixed access latency standing in for litehyperbus' HyperRAM, so firmware timings
+    # stay roughly representative
+    def __init__(self, size, init=[], latency=16):
+        self.bus = wishbone.Interface()
+        self.submodules.sram = sram = wishbone.SRAM(size, init=init)
+        count = Signal(max=latency + 1)
+        self.comb += [
+            self.bus.connect(sram.bus, omit={"stb"}),
+            sram.bus.stb.eq(self.bus.stb & (count == latency)),
+        ]
+        self.sync += [
+            If(self.bus.ack,
+                count.eq(0)
+            ).Elif(self.bus.cyc & self.bus.stb & (count != latency),
+                count.eq(count + 1)
+            )
+        ]
+
+# Runner -------------------------------------------------------------------------------------------
+
+class SimFrameReport(Module):
+    # Prints a marker each time the pipeline completes a frame (`frames` changes, sys domain), with the frames
+    # the D-PHY model has sent and the CSI-2 FIFO overflows so far; run_sim() turns these into frame rates
+    def __init__(self, frames, frame_sent, overflows):
+        sent = Signal(32)
+        self.submodules.sent_ps = sent_ps = PulseSynchronizer("mipi", "sys")
+        self.comb += sent_ps.i.eq(frame_sent)
+        self.sync += If(sent_ps.o, sent.eq(sent + 1))
+        self.specials += Instance("sim_frame_report", i_clk=ClockSignal(), i_frames=frames, i_sent=sent,
+            i_overflows=overflows)
+
+def run_sim(gateware_dir):
+    # Runs the compiled Verilator model, passing the console through and turning frame markers into
+    # wall-clock frame rate reports
+    proc = subprocess.Popen(["obj_dir/Vsim"], cwd=gateware_dir, stdout=subprocess.PIPE)
+    marker = re.compile(rb"\[sim\] frame end (\d+) (\d+)\r?\n")
+    start = time.monotonic()
+    frames = 0
+    buf = b""
+    try:
+        while True:
+            chunk = os.read(proc.stdout.fileno(), 4096)
+            if not chunk:
+                break
+            buf += chunk
+            while True:
+                m = marker.search(buf)
+                if m is None:
+                    break
+                sys.stdout.buffer.write(buf[:m.start()])
+                frames += 1
+                fps = frames / (time.monotonic() - start)
+                sys.stdout.buffer.write("[sim] frame {} completed ({} sent, {} FIFO overflows): {:.3f} frames/s wall time\r\n".format(
+                    frames, int(m.group(1)), int(m.group(2)), fps).encode())
+                buf = buf[m.end():]
+            # hold back a possible partial marker
+            keep = buf.rfind(b"[")
+            tail = buf[keep:]
+            if keep == -1 or b"\n" in tail or not (b"[sim] frame end".startswith(tail) or tail.startswith(b"[sim] frame end")):
+                keep = len(buf)
+            sys.stdout.buffer.write(buf[:keep])
+            sys.stdout.buffer.flush()
+            buf = buf[keep:]
+    except KeyboardInterrupt:
+        pass
+    proc.wait()
+
+# Gateware checks ----------------------------------------------------------------------------------
+# Cycle-level checks of single cores with migen's simulator; `python sim.py` runs them all
+
+def _lmmi_access(master, write, offset, wdata=0):
+    yield from master.control.write(1 | (write << 1) | (offset << 8) | (wdata << 16))
+    yield
+    while (yield master.status.fields.busy):
+        yield
+    return (yield master.status.fields.error), (yield master.status.fields.rdata)
+
+def check_lmmi():
+    # LMMIMaster against the slave model, including reads answered in the same cycle as ready
+    for ready_latency, read_latency in [(3, 2), (1, 1), (2, 0), (0, 0)]:
+        lmmi = Record(lmmi_layout)
+        dut = Module()
+        dut.submodules.master = master = LMMIMaster(lmmi, timeout=16)
+        dut.submodules.slave = SimLMMISlave(lmmi, ready_latency, read_latency)
+        errors = []
+        def generator():
+            values = {3: 0xA, 17: 0x5, 31: 0xF}
+            for offset, value in values.items():
+                error, _ = yield from _lmmi_access(master, 1, offset, value)
+                if error:
+                    errors.append("write {} timed out".format(offset))
+            for offset, value in values.items():
+                error, rdata = yield from _lmmi_access(master, 0, offset)
+                if error or rdata != value:
+                    errors.append("read {}: error {}, {:x} instead of {:x}".format(offset, error, rdata, value))
+        run_simulation(dut, generator())
+        print("lmmi ready latency {}, read latency {}: {}".format(ready_latency, read_latency,
+            "; ".join(errors) if errors else "ok"))
+        assert not errors
+
+def _csi_packet(sink, data_type, words=[], word_count=0):
+    # Header beat, then the payload words with last on the final one; a short packet is the header alone
+    beats = [0] + words
+    for i, data in enumerate(beats):
+        yield sink.valid.eq(1)
+        yield sink.first.eq(i == 0)
+        yield sink.last.eq(i == len(beats) - 1)
+        yield sink.data.eq(data)
+        yield sink.data_type.eq(data_type)
+        yield sink.word_count.eq(word_count)
+        yield
+    yield sink.valid.eq(0)
+    for i in range(4):
+        yield
+
+def _csi_frame(sink, pixels, width, height):
+    yield from _csi_packet(sink, 0x00)
+    for y in range(height):
+        line = pack_raw10(pixels[y*width:(y+1)*width])
+        words = [int.from_bytes(line[i:i+4], "little") for i in range(0, len(line), 4)]
+        yield from _csi_packet(sink, 0x2B, words, len(line))
+    yield from _csi_packet(sink, 0x01)
+    # blanking: lets the pipeline drain and the reference copy of the last tile row finish
+    for i in range(400):
+        yield
+
+def check_change_map():
+    # A step change that stays is reported in exactly one frame; the first frame is compared against reset data
+    width, height = 32, 16
+    dut = PyramidCapture([("changes", ChangeMap(max_width=8, max_height=4, step_x=2, step_y=2, tile=4))])
+    changes = dut.changes
+    before = [100] * (width * height)
+    after = [400 if x < width // 2 else 100 for y in range(height) for x in range(width)]
+    frames = [before, before, after, after, after]
+    expected = [1, 0, 1, 0, 0]
+    events = [0]
+    seen = []
+    @passive
+    def monitor():
+        while True:
+            if (yield changes.event):
+                events[0] += 1
+            yield
+    def generator():
+        for pixels in frames:
+            yield from _csi_frame(dut.sink, pixels, width, height)
+            seen.append(events[0])
+            events[0] = 0
+    run_simulation(dut, [generator(), monitor()])
+    print("change map events per frame: {} (expected {}): {}".format(seen, expected,
+        "ok" if seen == expected else "mismatch"))
+    assert seen == expected
+
+if __name__ == "__main__":
+    check_lmmi()
+    check_change_map()
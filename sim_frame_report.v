@@ -0,0 +1,10 @@
+// Prints a marker each time the pipeline completes a frame, with the frames sent by SimDPHY and the CSI-2 FIFO
+// overflows so far; sim.run_sim() turns these into frame rate reports
+module sim_frame_report(input clk, input [31:0] frames, input [31:0] sent, input [31:0] overflows);
+	reg [31:0] last = 0;
+	always @(posedge clk)
+		if (frames != last) begin
+			last <= frames;
+			$display("[sim] frame end %0d %0d", sent, overflows);
+		end
+endmodule
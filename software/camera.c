@@ -8,6 +8,7 @@
 #include "imx258_regs.h"
 
 #include "camera.h"
+#include "profile.h"
 
 #define CAM_ADDR 0x1a
 
@@ -79,12 +80,15 @@ static bool cam_write8(unsigned char slave_addr, unsigned short addr, unsigned c
 static bool run_init_sequence(const struct imx258_reg *regs, int count)
 {
 	int i;
+	PROF_BEGIN(PROF_RUN_INIT_SEQUENCE);
 	for (i = 0; i < count; i++) {
 		if (!cam_write8(CAM_ADDR, regs[i].address, regs[i].val)) {
 			printf("write %d failed (addr=%04x, data=%02x)!\n", i, regs[i].address, regs[i].val);
+			PROF_END(PROF_RUN_INIT_SEQUENCE);
 			return false;
 		} 
 	}
+	PROF_END(PROF_RUN_INIT_SEQUENCE);
 	return true;
 }
 
@@ -119,10 +123,10 @@ static const struct imx258_reg lattice_rd_cfg[] = {
 	{0x0902, 0x00}, //  BINNING_WEIGHT 0:Average
 	{0x0112, 0x0A}, //  CSI_DT_FMT_H 0A:RAW10
 	{0x0113, 0x0A}, //  CSI_DT_FMT_L 0A:RAW10
-	{0x034C, 0x07}, //  X_OUT_SIZE
-	{0x034D, 0x80}, //  X_OUT_SIZE  0x780=1920
-	{0x034E, 0x04}, //  Y_OUT_SIZE 
-	{0x034F, 0x38}, //  Y_OUT_SIZE  0x438=1080
+	{0x034C, CAM_WIDTH >> 8},    //  X_OUT_SIZE
+	{0x034D, CAM_WIDTH & 0xFF},  //  X_OUT_SIZE  0x780=1920
+	{0x034E, CAM_HEIGHT >> 8},   //  Y_OUT_SIZE
+	{0x034F, CAM_HEIGHT & 0xFF}, //  Y_OUT_SIZE  0x438=1080
 	{0x0401, 0x00}, //  SCALE_MODE 0:None
 	{0x0408, 0x00}, //  DIG_CROP_X_OFFSET
 	{0x0409, 0x00}, //  DIG_CROP_X_OFFSET
@@ -191,3 +195,49 @@ void camera_init(void) {
 	printf("IMX258_REG_CHIP_ID %04x\n", cam_read16(CAM_ADDR, IMX258_REG_CHIP_ID));
 	run_init_sequence(lattice_rd_cfg, ARRAY_SIZE(lattice_rd_cfg));
 }
+
+void camera_set_test_pattern(unsigned mode, unsigned r, unsigned gr, unsigned b, unsigned gb)
+{
+	const struct imx258_reg regs[] = {
+		{0x0602, (r >> 8) & 0x03}, {0x0603, r & 0xFF},
+		{0x0604, (gr >> 8) & 0x03}, {0x0605, gr & 0xFF},
+		{0x0606, (b >> 8) & 0x03}, {0x0607, b & 0xFF},
+		{0x0608, (gb >> 8) & 0x03}, {0x0609, gb & 0xFF},
+		{IMX258_REG_TEST_PATTERN, 0x00},
+		{IMX258_REG_TEST_PATTERN + 1, mode},
+	};
+	run_init_sequence(regs, ARRAY_SIZE(regs));
+}
+
+void camera_set_link_mpy(unsigned mpy)
+{
+	unsigned mbps = CAM_LINK_MBPS(mpy);
+	const struct imx258_reg regs[] = {
+		{IMX258_REG_MODE_SELECT, IMX258_MODE_STANDBY},
+		{0x030E, (mpy >> 8) & 0x07}, //  PLL_IOP_MPY[10:8]
+		{0x030F, mpy & 0xFF}, //  PLL_IOP_MPY[7:0]
+		{0x0820, (mbps >> 8) & 0xFF}, //  REQ_LINK_BIT_RATE_MBPS[31:24]
+		{0x0821, mbps & 0xFF}, //  REQ_LINK_BIT_RATE_MBPS[23:16]
+		{0x0822, 0x00},
+		{0x0823, 0x00},
+		{IMX258_REG_MODE_SELECT, IMX258_MODE_STREAMING},
+	};
+	run_init_sequence(regs, ARRAY_SIZE(regs));
+}
+
+void camera_standby(bool fast)
+{
+	const struct imx258_reg regs[] = {
+		{IMX258_REG_FAST_STANDBY_CTL, fast ? 0x01 : 0x00},
+		{IMX258_REG_MODE_SELECT, IMX258_MODE_STANDBY},
+	};
+	run_init_sequence(regs, ARRAY_SIZE(regs));
+}
+
+void camera_stream(void)
+{
+	const struct imx258_reg regs[] = {
+		{IMX258_REG_MODE_SELECT, IMX258_MODE_STREAMING},
+	};
+	run_init_sequence(regs, ARRAY_SIZE(regs));
+}
@@ -1,6 +1,25 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
+#include <stdbool.h>
+
+// IMX258 test pattern modes (register 0x0601)
+#define CAM_TEST_PATTERN_NONE  0
+#define CAM_TEST_PATTERN_SOLID 1
+#define CAM_TEST_PATTERN_BARS  2
+
+// Total link rate for a given PLL_IOP_MPY, with the 27MHz INCK and PREPLLCK_OP_DIV of 2 used here
+#define CAM_LINK_MBPS(mpy) (27 * (mpy))
+#define CAM_DEFAULT_LINK_MPY 55
+
+// Output size set by the init sequence (X_OUT_SIZE / Y_OUT_SIZE)
+#define CAM_WIDTH  1920
+#define CAM_HEIGHT 1080
+
 void camera_init(void);
+void camera_set_test_pattern(unsigned mode, unsigned r, unsigned gr, unsigned b, unsigned gb);
+void camera_set_link_mpy(unsigned mpy);
+void camera_standby(bool fast);
+void camera_stream(void);
 
 #endif
@@ -0,0 +1,28 @@
+#include <generated/csr.h>
+
+#include "dphy.h"
+
+static bool lmmi_transfer(unsigned offset, unsigned value, bool write)
+{
+	dphy_lmmi_control_write(
+		(1 << CSR_DPHY_LMMI_CONTROL_START_OFFSET) |
+		((write ? 1 : 0) << CSR_DPHY_LMMI_CONTROL_WRITE_OFFSET) |
+		((offset & 0x1F) << CSR_DPHY_LMMI_CONTROL_OFFSET_OFFSET) |
+		((value & 0xF) << CSR_DPHY_LMMI_CONTROL_WDATA_OFFSET));
+	while (dphy_lmmi_status_read() & (1 << CSR_DPHY_LMMI_STATUS_BUSY_OFFSET))
+		;
+	return !(dphy_lmmi_status_read() & (1 << CSR_DPHY_LMMI_STATUS_ERROR_OFFSET));
+}
+
+bool dphy_read(unsigned offset, unsigned *value)
+{
+	if (!lmmi_transfer(offset, 0, false))
+		return false;
+	*value = (dphy_lmmi_status_read() >> CSR_DPHY_LMMI_STATUS_RDATA_OFFSET) & 0xF;
+	return true;
+}
+
+bool dphy_write(unsigned offset, unsigned value)
+{
+	return lmmi_transfer(offset, value, true);
+}
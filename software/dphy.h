@@ -0,0 +1,12 @@
+#ifndef DPHY_H
+#define DPHY_H
+
+#include <stdbool.h>
+
+#define DPHY_LMMI_REGS 32
+
+// 4-bit D-PHY configuration registers over LMMI; return false if the D-PHY didn't respond
+bool dphy_read(unsigned offset, unsigned *value);
+bool dphy_write(unsigned offset, unsigned value);
+
+#endif
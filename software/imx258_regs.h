@@ -7,6 +7,9 @@
 #define IMX258_MODE_STANDBY		0x00
 #define IMX258_MODE_STREAMING		0x01
 
+/* 1: enter standby immediately on mode select 0 instead of at the end of the frame */
+#define IMX258_REG_FAST_STANDBY_CTL	0x0106
+
 /* Chip ID */
 #define IMX258_REG_CHIP_ID		0x0016
 #define IMX258_CHIP_ID			0x0258
@@ -7,6 +7,8 @@
 #include <uart.h>
 
 void isr(void);
+void changes_isr(void);
+void snap_isr(void);
 
 #ifdef CONFIG_CPU_HAS_INTERRUPT
 
@@ -20,6 +22,14 @@ void isr(void)
 	if(irqs & (1 << UART_INTERRUPT))
 		uart_isr();
 #endif
+#ifdef PYRAMID_INTERRUPT
+	if(irqs & (1 << PYRAMID_INTERRUPT))
+		changes_isr();
+#endif
+#ifdef SNAPSHOT_INTERRUPT
+	if(irqs & (1 << SNAPSHOT_INTERRUPT))
+		snap_isr();
+#endif
 }
 
 #else
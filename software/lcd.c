@@ -6,6 +6,7 @@
 
 
 #include "lcd.h"
+#include "profile.h"
 
 
 #define ST77XX_NOP 0x00
@@ -140,6 +141,7 @@ static const uint8_t lcd_gmctrn1[16] = {
 };
 
 void lcd_init(void) {
+	PROF_BEGIN(PROF_LCD_INIT);
 	reset_lcd();
 
     lcd_write_cmd(ST77XX_SWRESET); //  1: Software reset, 0 args, w/delay
@@ -221,8 +223,23 @@ void lcd_init(void) {
    			lcd_write_data(ST7735_RED);
    		}
    	}
+   	PROF_END(PROF_LCD_INIT);
 }
 
 void lcd_write_begin(void) {
    	lcd_write_cmd(ST77XX_RAMWR);
+}
+
+// Following writes fill the w x h rectangle at x, y, row by row (panel rows start at 0x20, as in lcd_init)
+void lcd_set_window(unsigned x, unsigned y, unsigned w, unsigned h) {
+	lcd_write_cmd(ST77XX_CASET);
+	lcd_write_param(0x00);
+	lcd_write_param(x);
+	lcd_write_param(0x00);
+	lcd_write_param(x + w - 1);
+	lcd_write_cmd(ST77XX_RASET);
+	lcd_write_param(0x00);
+	lcd_write_param(0x20 + y);
+	lcd_write_param(0x00);
+	lcd_write_param(0x20 + y + h - 1);
 }
\ No newline at end of file
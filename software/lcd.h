@@ -5,5 +5,6 @@ void lcd_init(void);
 
 void lcd_write_begin(void);
 void lcd_write_data(uint16_t value);
+void lcd_set_window(unsigned x, unsigned y, unsigned w, unsigned h);
 
 #endif
@@ -4,15 +4,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 
 #include <irq.h>
+#include <system.h>
 #include <uart.h>
 #include <console.h>
 #include <generated/csr.h>
 #include <generated/mem.h>
+#include <generated/soc.h>
 
 #include "camera.h"
 #include "lcd.h"
+#include "dphy.h"
+#include "profile.h"
+#include "pixel.h"
 
 /*-----------------------------------------------------------------------*/
 /* Uart                                                                  */
@@ -89,9 +95,35 @@ static void help(void)
 	puts("reboot             - Reboot CPU");
 	puts("cam_init           - Run camera initialisation");
 	puts("freq               - Print frequency counter output");
-	puts("data               - Print 32 words of received MIPI data");
+	puts("trace [mode] [n]   - Trace raw D-PHY lanes, n samples after a now, sync or skew trigger");
 	puts("packet             - Print 128 words of last received packet");
-	puts("image              - Print 60x33 downsampled image");
+	puts("csi                - Print CSI-2 FIFO overflows and last header");
+	puts("image              - Print 96x54 downsampled image");
+	puts("imgbench           - Time reading a held preview frame the old way, uncached and through the cache");
+	puts("pyramid            - Print preview pyramid levels");
+	puts("changes [watch]    - Print the tile change map of the last frame, or of each changed frame");
+	puts("changes thresh [n] - Set the per tile difference threshold of the change map");
+	puts("pixbench           - Time pixel loops with and without the custom instructions");
+	puts("accum sum [n]      - Sum n frames at pyramid resolution, then show the result");
+	puts("accum ema [d]|stop - Start or stop a moving average with weight 2^-d, then show the result");
+	puts("roi [x y]          - Capture a 256x64 full resolution window and print stats");
+	puts("roi show           - Print the last window, one character per Bayer quad");
+	puts("prof               - Print and reset firmware profiling counters");
+	puts("linktest [n]       - Check n frames of the solid colour test pattern for bit errors");
+	puts("linktest n bars    - The same with the colour bar test pattern");
+	puts("linktest n p order - Set the checker's R/Gr/Gb/B order (bit 0 swaps columns, bit 1 rows), p solid or bars");
+	puts("linktest sweep [n] - Run linktest over a range of link rates");
+	puts("dphy               - Dump D-PHY LMMI registers");
+	puts("dphy r off         - Read D-PHY LMMI register off");
+	puts("dphy w off val     - Write D-PHY LMMI register off");
+	puts("dphy sweep r lo hi - Run linktest for each value lo..hi of D-PHY register r (n frames as 4th arg)");
+	puts("snap [on|off]      - Take a single snapshot, or enter/leave snapshot mode");
+	puts("compress           - Losslessly compress one frame into main_ram and print stats");
+	puts("compress dump      - Print the compressed frame as hex for line_codec.py");
+#ifdef CSR_HR_CACHE_BASE
+	puts("cache [mode]       - Set the HyperRAM cache on, noprefetch or off and print its hit counters");
+	puts("cache bench        - Time camera_init and memcpy with the HyperRAM cache off and on");
+#endif
 
 }
 
@@ -105,15 +137,15 @@ static void read_freq_cmd(void)
 	printf("Byte clk freq: %dHz\n", clk_byte_freq_value_read());
 }
 
-static void read_data_cmd(void)
+static void read_line_count_cmd(void)
 {
-	for (int i = 0; i < 32; i++)
-		printf("%08x %08x %01x\n", dphy_header_in_read(), hs_rx_data_in_read(), hs_rx_sync_in_read());
+	printf("Line count: %d\n", line_count_in_read());
 }
 
-static void read_line_count_cmd(void)
+static void read_csi_cmd(void)
 {
-	printf("Line count: %d\n", line_count_in_read());
+	printf("Last header: %08x\n", csi_header_read());
+	printf("FIFO overflows: %d\n", csi_overflows_read());
 }
 
 static void read_packet_cmd(void)
@@ -123,57 +155,979 @@ static void read_packet_cmd(void)
 		printf("%08x\n", buf[i]);
 }
 
+// Called by the commands that wait for a key, see Snapshot
+static void snap_service(void);
+
+/*-----------------------------------------------------------------------*/
+/* Change map                                                            */
+/*-----------------------------------------------------------------------*/
+
+// Tiles of 4x4 quads of the change map level (tile in the gateware); one bitmap word per tile row
+#define CHANGES_TILE     4
+#define CHANGES_MAX_ROWS 32
+
+// Frames with at least one changed tile, counted by the pyramid interrupt
+static volatile unsigned changes_events;
+
+void changes_isr(void);
+void changes_isr(void)
+{
+	pyramid_ev_pending_write(pyramid_ev_pending_read());
+	changes_events++;
+}
+
+static void changes_init(void)
+{
+	pyramid_ev_pending_write(pyramid_ev_pending_read());
+	pyramid_ev_enable_write(1 << CSR_PYRAMID_EV_ENABLE_CHANGES_OFFSET);
+#ifdef CONFIG_CPU_HAS_INTERRUPT
+	irq_setmask(irq_getmask() | (1 << PYRAMID_INTERRUPT));
+#endif
+}
+
+static void changes_show(void)
+{
+	uint32_t frame;
+	uint32_t rows[CHANGES_MAX_ROWS];
+	unsigned tiles_x = (pyramid_changes_width_read() + CHANGES_TILE - 1) / CHANGES_TILE;
+	unsigned tiles_y = (pyramid_changes_height_read() + CHANGES_TILE - 1) / CHANGES_TILE;
+	if (tiles_x > 32)
+		tiles_x = 32;
+	if (tiles_y > CHANGES_MAX_ROWS)
+		tiles_y = CHANGES_MAX_ROWS;
+
+	// the bitmap bank swaps at frame end, so retry if that happened while reading
+	do {
+		frame = pyramid_changes_frame_read();
+		for (unsigned y = 0; y < tiles_y; y++) {
+			pyramid_changes_row_write(y);
+			rows[y] = pyramid_changes_bitmap_read();
+		}
+	} while (pyramid_changes_frame_read() != frame);
+
+	printf("frame %u: %u changed tiles\n", frame, pyramid_changes_changed_read());
+	for (unsigned y = 0; y < tiles_y; y++) {
+		for (unsigned x = 0; x < tiles_x; x++)
+			putchar((rows[y] >> x) & 1 ? '#' : '.');
+		putchar('\n');
+	}
+}
+
+static void changes_cmd(char *str)
+{
+	char *token = get_token(&str);
+
+	if (strcmp(token, "thresh") == 0) {
+		token = get_token(&str);
+		if (*token)
+			pyramid_changes_threshold_write(strtoul(token, NULL, 0));
+		printf("threshold %u\n", pyramid_changes_threshold_read());
+	} else if (strcmp(token, "watch") == 0) {
+		// prints the map only for frames that changed; any key stops
+		unsigned seen = changes_events;
+		while (!readchar_nonblock()) {
+			snap_service();
+			if (changes_events != seen) {
+				seen = changes_events;
+				changes_show();
+			}
+		}
+		readchar();
+	} else {
+		changes_show();
+	}
+}
+
+/*-----------------------------------------------------------------------*/
+/* Image                                                                 */
+/*-----------------------------------------------------------------------*/
+
+// One 32-bit word per 2x2 Bayer quad, see pixel.h
+#define IMAGE_WIDTH  96
+#define IMAGE_HEIGHT 54
+#define LCD_LEVEL_WIDTH  120
+#define LCD_LEVEL_HEIGHT 68
+#define LCD_SIZE 128
+
+// Holds the bank with the last complete frame until image_release(), so it isn't overwritten however long the
+// reader takes (printing it over the UART takes seconds). The level has a single bank, so this first waits for
+// the frame being written to end; if none ends the stream has stopped and nothing is written anyway. The held
+// bank can be read through the cache; stale lines are dropped whenever a different frame is held than last time
+static const uint32_t *image_hold(void)
+{
+	static uint32_t last_frame = 0xFFFFFFFF;
+	pyramid_thumb_hold_write(1);
+	for (int ms = 0; ms < 200 && !pyramid_thumb_held_read(); ms++)
+		busy_wait(1);
+	// no swap can happen from here on, so frame and front belong together
+	uint32_t frame = pyramid_thumb_frame_read();
+	if (frame != last_frame) {
+		flush_cpu_dcache();
+		last_frame = frame;
+	}
+	return (const uint32_t *)IMAGE_IO_BASE + pyramid_thumb_front_read() * (IMAGE_WIDTH * IMAGE_HEIGHT);
+}
+
+static void image_release(void)
+{
+	pyramid_thumb_hold_write(0);
+}
+
 static void read_image_cmd(void)
 {
-	volatile unsigned *buf = (volatile unsigned *)IMAGE_IO_BASE;
-	// GBRGB
-	for (int y = 0; y < 54; y++) {
-		for (int x = 0; x < 96; x++) {
+	PROF_BEGIN(PROF_READ_IMAGE);
+	const uint32_t *buf = image_hold();
+	for (int y = 0; y < IMAGE_HEIGHT; y++) {
+		for (int x = 0; x < IMAGE_WIDTH; x++) {
 			// Nonstandard 24 bit colour mode
-			// GBRG ?
-			unsigned g0 = (buf[(y * 2) * 96 + x] >> 8) & 0xFF;
-			unsigned r = (buf[(y * 2) * 96 + x]) & 0xFF;
-			unsigned b = (buf[(y * 2 + 1) * 96 + x] >> 8) & 0xFF;
-
-			printf("\e[48;2;%d;%d;%dm ", r, g0, b);
+			uint32_t q = buf[y * IMAGE_WIDTH + x];
+			printf("\e[48;2;%d;%d;%dm ", pix_extract(q, 0), pix_extract(q, 1), pix_extract(q, 3));
 		}
 		printf("\e[0m\n");
 	}
+	image_release();
+	PROF_END(PROF_READ_IMAGE);
+}
+
+// As image_hold(), for the LCD level
+static const uint32_t *lcd_level_hold(void)
+{
+	static uint32_t last_frame = 0xFFFFFFFF;
+	pyramid_lcd_hold_write(1);
+	for (int ms = 0; ms < 200 && !pyramid_lcd_held_read(); ms++)
+		busy_wait(1);
+	uint32_t frame = pyramid_lcd_frame_read();
+	if (frame != last_frame) {
+		flush_cpu_dcache();
+		last_frame = frame;
+	}
+	return (const uint32_t *)LCD_IO_BASE + pyramid_lcd_front_read() * (LCD_LEVEL_WIDTH * LCD_LEVEL_HEIGHT);
 }
 
+// The LCD level of the pyramid is 120x68, the whole frame at the sensor's aspect ratio, so it is copied out as
+// is into a window in the middle of the panel. It is only redrawn after the change map has seen the frame
+// differ from what it last reported
 static void write_lcd_cmd(void)
 {
+	unsigned drawn = changes_events - 1;
+
+	lcd_set_window(0, 0, LCD_SIZE, LCD_SIZE);
+	lcd_write_begin();
+	for (int i = 0; i < LCD_SIZE * LCD_SIZE; i++)
+		lcd_write_data(0);
+	lcd_set_window((LCD_SIZE - LCD_LEVEL_WIDTH) / 2, (LCD_SIZE - LCD_LEVEL_HEIGHT) / 2,
+		LCD_LEVEL_WIDTH, LCD_LEVEL_HEIGHT);
 	while (1) {
 		if (readchar_nonblock()) {
 			readchar();
 			break;
 		}
+		snap_service();
+		if (changes_events == drawn)
+			continue;
+		drawn = changes_events;
+		PROF_BEGIN(PROF_LCD_FRAME);
+		const uint32_t *buf = lcd_level_hold();
 		lcd_write_begin();
+		for (int i = 0; i < LCD_LEVEL_WIDTH * LCD_LEVEL_HEIGHT; i++) {
+			lcd_write_data(pix_rgb565(buf[i]));
+		}
+		pyramid_lcd_hold_write(0);
+		PROF_END(PROF_LCD_FRAME);
+
+	}
+	lcd_set_window(0, 0, LCD_SIZE, LCD_SIZE);
+}
+
+static void pyramid_cmd(void)
+{
+	printf("thumb: %dx%d every %d,%d quads, frame %d\n", pyramid_thumb_width_read(), pyramid_thumb_height_read(),
+		pyramid_thumb_step_x_read(), pyramid_thumb_step_y_read(), pyramid_thumb_frame_read());
+	printf("lcd:   %dx%d every %d,%d quads, frame %d\n", pyramid_lcd_width_read(), pyramid_lcd_height_read(),
+		pyramid_lcd_step_x_read(), pyramid_lcd_step_y_read(), pyramid_lcd_frame_read());
+	printf("dropped beats: %d\n", pyramid_drops_read());
+}
 
-		volatile unsigned *buf = (volatile unsigned *)IMAGE_IO_BASE;
-		// GBRGB
-		for (int y = 0; y < 128; y++) {
-			for (int x = 0; x < 128; x++) {
+/*-----------------------------------------------------------------------*/
+/* Frame accumulation                                                    */
+/*-----------------------------------------------------------------------*/
 
-				int cx = (x * 96) / 128;
-				int cy = (y * 54) / 128;
+// Two words per quad, R/Gr then Gb/B, 16 bits per channel; sums of 10-bit pixels in mode 0,
+// moving averages with 6 fraction bits in mode 1
+#define ACCUM_WIDTH    48
+#define ACCUM_HEIGHT   27
+#define ACCUM_MODE_SUM 0
+#define ACCUM_MODE_EMA 1
 
-				// Nonstandard 24 bit colour mode
-				// GBRG ?
-				if (cx >= 96 || cy >= 54) {
-					lcd_write_data(0x0);
-				} else {
-					unsigned g0 = (buf[(cy * 2) * 96 + cx] >> 8) & 0xFF;
-					unsigned r = (buf[(cy * 2) * 96 + cx]) & 0xFF;
-					unsigned b = (buf[(cy * 2 + 1) * 96 + cx] >> 8) & 0xFF;
+static uint32_t accum_word(unsigned index)
+{
+	pyramid_accum_index_write(index);
+	return pyramid_accum_value_read();
+}
 
-					lcd_write_data( (((r >> 3) & 0x1F) << 11) | (((g0 >> 2) & 0x3F) << 5) | (((b >> 3) & 0x1F) << 0));
-				}
+// Normalised 8-bit value of the 16-bit channel at bit offset shift
+static unsigned accum_channel(uint32_t word, int shift, bool ema, unsigned frames)
+{
+	unsigned v = (word >> shift) & 0xFFFF;
+	return (ema ? (v >> 6) : (v / frames)) >> 2;
+}
+
+static void accum_show(void)
+{
+	uint32_t status = pyramid_accum_status_read();
+	bool ema = (status >> CSR_PYRAMID_ACCUM_STATUS_MODE_OFFSET) & 1;
+	unsigned frames = status >> CSR_PYRAMID_ACCUM_STATUS_COUNT_OFFSET;
+	if (frames == 0) {
+		printf("Nothing accumulated\n");
+		return;
+	}
+	uint32_t green = 0;
+	for (int y = 0; y < ACCUM_HEIGHT; y++) {
+		for (int x = 0; x < ACCUM_WIDTH; x++) {
+			uint32_t even = accum_word(2 * (y * ACCUM_WIDTH + x));
+			uint32_t odd = accum_word(2 * (y * ACCUM_WIDTH + x) + 1);
+			unsigned g = accum_channel(even, 16, ema, frames);
+			green += g;
+			printf("\e[48;2;%d;%d;%dm ", accum_channel(even, 0, ema, frames), g, accum_channel(odd, 16, ema, frames));
+		}
+		printf("\e[0m\n");
+	}
+	printf("%s of %d frames, mean green %d\n", ema ? "Moving average" : "Sum", frames,
+		green / (ACCUM_WIDTH * ACCUM_HEIGHT));
+}
+
+static void accum_cmd(char *str)
+{
+	char *token = get_token(&str);
+	if (strcmp(token, "sum") == 0) {
+		token = get_token(&str);
+		unsigned frames = (*token) ? strtoul(token, NULL, 0) : 16;
+		if (frames < 1 || frames > 64) {
+			printf("Frame count must be 1 to 64\n");
+			return;
+		}
+		pyramid_accum_frames_write(frames);
+		pyramid_accum_control_write((1 << CSR_PYRAMID_ACCUM_CONTROL_START_OFFSET) |
+			(ACCUM_MODE_SUM << CSR_PYRAMID_ACCUM_CONTROL_MODE_OFFSET));
+		// allow ~10 frames per second plus some slack
+		for (unsigned ms = 0; ms < frames * 100 + 500; ms++) {
+			if (pyramid_accum_status_read() & (1 << CSR_PYRAMID_ACCUM_STATUS_DONE_OFFSET))
+				break;
+			busy_wait(1);
+		}
+		if (!(pyramid_accum_status_read() & (1 << CSR_PYRAMID_ACCUM_STATUS_DONE_OFFSET))) {
+			printf("Timed out\n");
+			return;
+		}
+	} else if (strcmp(token, "ema") == 0) {
+		token = get_token(&str);
+		pyramid_accum_decay_write((*token) ? strtoul(token, NULL, 0) : 3);
+		pyramid_accum_control_write((1 << CSR_PYRAMID_ACCUM_CONTROL_START_OFFSET) |
+			(ACCUM_MODE_EMA << CSR_PYRAMID_ACCUM_CONTROL_MODE_OFFSET));
+		printf("Moving average running, 'accum' to show it\n");
+		return;
+	} else if (strcmp(token, "stop") == 0) {
+		pyramid_accum_control_write(1 << CSR_PYRAMID_ACCUM_CONTROL_STOP_OFFSET);
+		return;
+	}
+	accum_show();
+}
+
+// Full resolution window, packed RAW10 as received
+#define ROI_WIDTH      256
+#define ROI_HEIGHT     64
+#define ROI_LINE_BYTES (ROI_WIDTH * 5 / 4)
+
+static unsigned roi_pixel(const uint8_t *line, int x)
+{
+	const uint8_t *group = &line[(x / 4) * 5];
+	return (group[x % 4] << 2) | ((group[4] >> (2 * (x % 4))) & 0x3);
+}
+
+static void roi_show(void)
+{
+	const uint8_t *buf = (const uint8_t *)ROI_IO_BASE;
+	for (int y = 0; y < ROI_HEIGHT; y += 2) {
+		const uint8_t *even = &buf[y * ROI_LINE_BYTES];
+		const uint8_t *odd = &buf[(y + 1) * ROI_LINE_BYTES];
+		for (int x = 0; x < ROI_WIDTH; x += 2)
+			printf("\e[48;2;%d;%d;%dm ", roi_pixel(even, x) >> 2, roi_pixel(even, x + 1) >> 2, roi_pixel(odd, x + 1) >> 2);
+		printf("\e[0m\n");
+	}
+}
+
+static void roi_cmd(char *str)
+{
+	char *token = get_token(&str);
+	if (strcmp(token, "show") == 0) {
+		roi_show();
+		return;
+	}
+	if (*token) {
+		// x is rounded down to the 16 pixel granularity of the capture
+		roi_cap_x_write(strtoul(token, NULL, 0) / 16);
+		roi_cap_y_write(strtoul(get_token(&str), NULL, 0));
+	}
+	roi_cap_control_write(1 << CSR_ROI_CAP_CONTROL_ARM_OFFSET);
+	for (int ms = 0; ms < 1000; ms++) {
+		if (roi_cap_status_read() & (1 << CSR_ROI_CAP_STATUS_DONE_OFFSET))
+			break;
+		busy_wait(1);
+	}
+	uint32_t status = roi_cap_status_read();
+	if (!(status & (1 << CSR_ROI_CAP_STATUS_DONE_OFFSET))) {
+		printf("No frame received\n");
+		return;
+	}
+	if (status & (1 << CSR_ROI_CAP_STATUS_CLIPPED_OFFSET))
+		printf("Window extends past the end of a line\n");
+	else if (!(status & (1 << CSR_ROI_CAP_STATUS_COMPLETE_OFFSET)))
+		printf("Window extends past the end of the frame\n");
+	flush_cpu_dcache();
+
+	// sharpness: mean absolute difference between horizontally adjacent same-colour pixels
+	const uint8_t *buf = (const uint8_t *)ROI_IO_BASE;
+	unsigned min = 0x3FF, max = 0;
+	uint32_t grad = 0;
+	for (int y = 0; y < ROI_HEIGHT; y++) {
+		const uint8_t *line = &buf[y * ROI_LINE_BYTES];
+		for (int x = 0; x < ROI_WIDTH; x++) {
+			unsigned p = roi_pixel(line, x);
+			if (p < min)
+				min = p;
+			if (p > max)
+				max = p;
+			if (x >= 2)
+				grad += abs((int)p - (int)roi_pixel(line, x - 2));
+		}
+	}
+	printf("ROI at %d,%d: min %d max %d sharpness %d\n", roi_cap_x_read() * 16, roi_cap_y_read(), min, max,
+		grad / (ROI_HEIGHT * (ROI_WIDTH - 2)));
+}
+
+// Times the ways of reading a held preview frame, all on the same frame
+static void imgbench_cmd(void)
+{
+	const uint32_t *cached = image_hold();
+	volatile uint32_t *uncached = (volatile uint32_t *)IMAGE_IO_UNCACHED_BASE + (cached - (const uint32_t *)IMAGE_IO_BASE);
+	uint32_t sum_old = 0, sum_uncached = 0, sum_cold = 0, sum_warm = 0;
+	uint64_t start;
+	uint32_t t_old, t;
+
+	// Baseline: the loop of the old 16-bit capture, three separate uncached reads per pixel with R and G from
+	// row 2y and B from row 2y + 1. That layout had twice the rows, so here they wrap around
+	start = prof_cycles();
+	for (int y = 0; y < IMAGE_HEIGHT; y++) {
+		for (int x = 0; x < IMAGE_WIDTH; x++) {
+			int row = (y * 2) % IMAGE_HEIGHT;
+			sum_old += (uncached[row * IMAGE_WIDTH + x] >> 8) & 0xFF;
+			sum_old += uncached[row * IMAGE_WIDTH + x] & 0xFF;
+			sum_old += (uncached[(row + 1) * IMAGE_WIDTH + x] >> 8) & 0xFF;
+		}
+	}
+	t_old = prof_cycles() - start;
+	(void)sum_old;
+	printf("uncached, old pattern: %u cycles\n", t_old);
+
+	start = prof_cycles();
+	for (int i = 0; i < IMAGE_WIDTH * IMAGE_HEIGHT; i++)
+		sum_uncached += uncached[i];
+	t = prof_cycles() - start;
+	printf("uncached:              %u cycles, %u.%02ux faster\n", t, t_old / t, (t_old % t) * 100 / t);
+
+	flush_cpu_dcache();
+	start = prof_cycles();
+	for (int i = 0; i < IMAGE_WIDTH * IMAGE_HEIGHT; i++)
+		sum_cold += cached[i];
+	t = prof_cycles() - start;
+	printf("cached, cold:          %u cycles, %u.%02ux faster\n", t, t_old / t, (t_old % t) * 100 / t);
+
+	start = prof_cycles();
+	for (int i = 0; i < IMAGE_WIDTH * IMAGE_HEIGHT; i++)
+		sum_warm += cached[i];
+	t = prof_cycles() - start;
+	printf("cached, warm:          %u cycles, %u.%02ux faster\n", t, t_old / t, (t_old % t) * 100 / t);
+	image_release();
+
+	printf("checksum %08x%s\n", sum_uncached,
+		(sum_cold == sum_uncached && sum_warm == sum_uncached) ? "" : ", MISMATCH between read paths");
+}
+
+/*-----------------------------------------------------------------------*/
+/* Pixel instructions                                                    */
+/*-----------------------------------------------------------------------*/
+
+#define PIXBENCH_WORDS 4096
+
+// The same loops built on the C fallbacks (_sw) and, if present, the custom instructions
+#define PIXBENCH_LOOPS(suffix) \
+static uint32_t pixbench_rgb565##suffix(const uint32_t *b) \
+{ \
+	uint32_t s = 0; \
+	for (int i = 0; i < PIXBENCH_WORDS; i++) \
+		s += pix_rgb565##suffix(b[i]); \
+	return s; \
+} \
+static uint32_t pixbench_extract##suffix(const uint32_t *b) \
+{ \
+	uint32_t s = 0; \
+	for (int i = 0; i < PIXBENCH_WORDS; i++) \
+		s += pix_extract##suffix(b[i], i); \
+	return s; \
+} \
+static uint32_t pixbench_addsat##suffix(const uint32_t *b) \
+{ \
+	uint32_t s = 0; \
+	for (int i = 0; i < PIXBENCH_WORDS; i++) \
+		s += pix_addsat##suffix(b[i], 0x40404040); \
+	return s; \
+} \
+static uint32_t pixbench_avg##suffix(const uint32_t *b) \
+{ \
+	uint32_t s = 0; \
+	for (int i = 0; i < PIXBENCH_WORDS - 1; i += 2) \
+		s += pix_avg##suffix(b[i], b[i + 1]); \
+	return s; \
+}
+
+PIXBENCH_LOOPS(_sw)
+#ifdef PIXEL_CFU
+PIXBENCH_LOOPS()
+#endif
+
+struct pixbench {
+	const char *name;
+	uint32_t (*sw)(const uint32_t *);
+	uint32_t (*hw)(const uint32_t *);
+};
+
+static void pixbench_cmd(void)
+{
+	static uint32_t buf[PIXBENCH_WORDS];
+	static const struct pixbench tests[] = {
+#ifdef PIXEL_CFU
+		{"rgb565",  pixbench_rgb565_sw,  pixbench_rgb565},
+		{"extract", pixbench_extract_sw, pixbench_extract},
+		{"addsat",  pixbench_addsat_sw,  pixbench_addsat},
+		{"avg",     pixbench_avg_sw,     pixbench_avg},
+#else
+		{"rgb565",  pixbench_rgb565_sw,  NULL},
+		{"extract", pixbench_extract_sw, NULL},
+		{"addsat",  pixbench_addsat_sw,  NULL},
+		{"avg",     pixbench_avg_sw,     NULL},
+#endif
+	};
+
+	// work from SRAM so the loops, not the capture memory, are measured
+	flush_cpu_dcache();
+	memcpy(buf, (const uint32_t *)LCD_IO_BASE, sizeof(buf));
+	printf("%u words per loop, cycles per word:\n", PIXBENCH_WORDS);
+	for (unsigned i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+		uint64_t start = prof_cycles();
+		uint32_t sum_sw = tests[i].sw(buf);
+		uint32_t t_sw = prof_cycles() - start;
+		printf("%-8s C %3u.%02u", tests[i].name, t_sw / PIXBENCH_WORDS, (t_sw % PIXBENCH_WORDS) * 100 / PIXBENCH_WORDS);
+		if (tests[i].hw) {
+			start = prof_cycles();
+			uint32_t sum_hw = tests[i].hw(buf);
+			uint32_t t_hw = prof_cycles() - start;
+			printf("  CFU %3u.%02u%s", t_hw / PIXBENCH_WORDS, (t_hw % PIXBENCH_WORDS) * 100 / PIXBENCH_WORDS,
+				sum_hw == sum_sw ? "" : "  MISMATCH");
+		}
+		printf("\n");
+	}
+#ifndef PIXEL_CFU
+	printf("Built without the pixel CFU (--pixel-cfu)\n");
+#endif
+}
 
+/*-----------------------------------------------------------------------*/
+/* Link test                                                             */
+/*-----------------------------------------------------------------------*/
+
+// Alternating bit patterns, so every bit of every lane toggles
+#define LINKTEST_R  0x2AA
+#define LINKTEST_GR 0x155
+#define LINKTEST_B  0x0F0
+#define LINKTEST_GB 0x30F
+
+// R/Gr/Gb/B layout the checker expects, see `linktest`; kept for the sweeps
+static unsigned linktest_order;
+
+static bool linktest_run(unsigned mode, unsigned frames, bool verbose)
+{
+	uint32_t errors[4], bytes[4];
+	uint32_t total_errors = 0;
+
+	camera_set_test_pattern(mode, LINKTEST_R, LINKTEST_GR, LINKTEST_B, LINKTEST_GB);
+	pattern_check_colour_r_write(LINKTEST_R);
+	pattern_check_colour_gr_write(LINKTEST_GR);
+	pattern_check_colour_b_write(LINKTEST_B);
+	pattern_check_colour_gb_write(LINKTEST_GB);
+	// the sensor draws 8 bars across the line; the checker counts in 16 pixel groups
+	pattern_check_bar_width_write(CAM_WIDTH / 8 / 16);
+	pattern_check_frames_write(frames);
+	pattern_check_control_write(
+		(1 << CSR_PATTERN_CHECK_CONTROL_START_OFFSET) |
+		((mode == CAM_TEST_PATTERN_BARS ? 2 : 1) << CSR_PATTERN_CHECK_CONTROL_MODE_OFFSET) |
+		(linktest_order << CSR_PATTERN_CHECK_CONTROL_ORDER_OFFSET));
+
+	// allow ~10 frames per second plus some slack before giving up
+	for (unsigned ms = 0; ms < frames * 100 + 500; ms++) {
+		if (pattern_check_status_read() & (1 << CSR_PATTERN_CHECK_STATUS_DONE_OFFSET))
+			break;
+		busy_wait(1);
+	}
+
+	camera_set_test_pattern(CAM_TEST_PATTERN_NONE, 0, 0, 0, 0);
+
+	unsigned checked = (pattern_check_status_read() >> CSR_PATTERN_CHECK_STATUS_FRAMES_OFFSET) & 0xFFFF;
+	errors[0] = pattern_check_errors0_read();
+	errors[1] = pattern_check_errors1_read();
+	errors[2] = pattern_check_errors2_read();
+	errors[3] = pattern_check_errors3_read();
+	bytes[0] = pattern_check_bytes0_read();
+	bytes[1] = pattern_check_bytes1_read();
+	bytes[2] = pattern_check_bytes2_read();
+	bytes[3] = pattern_check_bytes3_read();
+
+	for (int i = 0; i < 4; i++) {
+		total_errors += errors[i];
+		if (verbose) {
+			uint64_t bits = (uint64_t)bytes[i] * 8;
+			unsigned ppb = bits ? (unsigned)(((uint64_t)errors[i] * 1000000000ULL) / bits) : 0;
+			printf("lane %d: %u errors in %llu bits, BER %u ppb\n", i, errors[i], (unsigned long long)bits, ppb);
+		}
+	}
+	if (checked != frames) {
+		printf("only %d of %d frames received\n", checked, frames);
+		return false;
+	}
+	return total_errors == 0;
+}
+
+static void linktest_cmd(char *str)
+{
+	char *token = get_token(&str);
+	if (strcmp(token, "sweep") == 0) {
+		token = get_token(&str);
+		unsigned frames = (*token) ? strtoul(token, NULL, 0) : 10;
+		unsigned best = 0;
+		for (unsigned mpy = 40; mpy <= 80; mpy += 5) {
+			camera_set_link_mpy(mpy);
+			busy_wait(200);
+			bool ok = linktest_run(CAM_TEST_PATTERN_SOLID, frames, false);
+			printf("%4d Mbps (byte clk %dHz): %s\n", CAM_LINK_MBPS(mpy), clk_byte_freq_value_read(), ok ? "ok" : "FAIL");
+			if (ok)
+				best = mpy;
+		}
+		camera_set_link_mpy(CAM_DEFAULT_LINK_MPY);
+		if (best)
+			printf("Fastest error-free rate: %d Mbps\n", CAM_LINK_MBPS(best));
+		return;
+	}
+	unsigned frames = (*token) ? strtoul(token, NULL, 0) : 10;
+	token = get_token(&str);
+	unsigned mode = (strcmp(token, "bars") == 0) ? CAM_TEST_PATTERN_BARS : CAM_TEST_PATTERN_SOLID;
+	token = get_token(&str);
+	if (*token)
+		linktest_order = strtoul(token, NULL, 0) & 3;
+	printf("%s\n", linktest_run(mode, frames, true) ? "PASS" : "FAIL");
+}
+
+/*-----------------------------------------------------------------------*/
+/* D-PHY                                                                 */
+/*-----------------------------------------------------------------------*/
+
+static void dphy_cmd(char *str)
+{
+	unsigned value;
+	char *token = get_token(&str);
+	if (*token == 0) {
+		for (unsigned i = 0; i < DPHY_LMMI_REGS; i++) {
+			if (!dphy_read(i, &value)) {
+				printf("LMMI read of %02x timed out\n", i);
+				return;
 			}
+			printf("%02x: %x%s", i, value, (i % 8) == 7 ? "\n" : "  ");
+		}
+	} else if (strcmp(token, "r") == 0) {
+		unsigned offset = strtoul(get_token(&str), NULL, 0);
+		if (dphy_read(offset, &value))
+			printf("%02x: %x\n", offset, value);
+		else
+			printf("LMMI read timed out\n");
+	} else if (strcmp(token, "w") == 0) {
+		unsigned offset = strtoul(get_token(&str), NULL, 0);
+		value = strtoul(get_token(&str), NULL, 0);
+		if (!dphy_write(offset, value))
+			printf("LMMI write timed out\n");
+	} else if (strcmp(token, "sweep") == 0) {
+		unsigned offset = strtoul(get_token(&str), NULL, 0);
+		unsigned lo = strtoul(get_token(&str), NULL, 0);
+		unsigned hi = strtoul(get_token(&str), NULL, 0);
+		token = get_token(&str);
+		unsigned frames = (*token) ? strtoul(token, NULL, 0) : 10;
+		unsigned orig;
+		if (!dphy_read(offset, &orig)) {
+			printf("LMMI read timed out\n");
+			return;
+		}
+		for (value = lo; value <= hi && value <= 0xF; value++) {
+			dphy_write(offset, value);
+			busy_wait(10);
+			printf("%02x = %x: %s\n", offset, value, linktest_run(CAM_TEST_PATTERN_SOLID, frames, false) ? "ok" : "FAIL");
+		}
+		dphy_write(offset, orig);
+	}
+}
+
+// Raw lane trace ahead of the WordAligner, which absorbs up to its depth - 1 byte clocks of skew
+#define TRACE_DEPTH    1024
+#define TRACE_PRE      16
+#define ALIGNER_DEPTH  3
+
+static void trace_cmd(char *str)
+{
+	static const char *modes[] = {"now", "sync", "skew"};
+	unsigned mode = 1;
+	char *token = get_token(&str);
+	for (unsigned i = 0; i < 3; i++) {
+		if (strcmp(token, modes[i]) == 0) {
+			mode = i;
+			token = get_token(&str);
+			break;
 		}
+	}
+	unsigned post = (*token) ? strtoul(token, NULL, 0) : 32;
+	if (post > TRACE_DEPTH - TRACE_PRE - 1)
+		post = TRACE_DEPTH - TRACE_PRE - 1;
+
+	dphy_trace_post_write(post);
+	dphy_trace_control_write((1 << CSR_DPHY_TRACE_CONTROL_ARM_OFFSET) | (mode << CSR_DPHY_TRACE_CONTROL_TRIGGER_OFFSET));
+	for (int ms = 0; ms < 1000; ms++) {
+		if (!(dphy_trace_status_read() & (1 << CSR_DPHY_TRACE_STATUS_BUSY_OFFSET)))
+			break;
+		busy_wait(1);
+	}
+	uint32_t status = dphy_trace_status_read();
+	if (status & (1 << CSR_DPHY_TRACE_STATUS_BUSY_OFFSET)) {
+		printf("No trigger\n");
+		return;
+	}
+
+	unsigned trig = dphy_trace_trigger_index_read();
+	unsigned pre = (status & (1 << CSR_DPHY_TRACE_STATUS_WRAPPED_OFFSET)) ? TRACE_PRE : trig;
+	if (pre > TRACE_PRE)
+		pre = TRACE_PRE;
+	int first_sync[4] = {-1, -1, -1, -1};
+	printf("   t  l0 l1 l2 l3 sync\n");
+	for (int t = -(int)pre; t <= (int)post; t++) {
+		dphy_trace_index_write((trig + TRACE_DEPTH + t) % TRACE_DEPTH);
+		uint32_t data = dphy_trace_sample_data_read();
+		unsigned sync = dphy_trace_sample_sync_read();
+		printf("%c%4d %02x %02x %02x %02x %x\n", t == 0 ? '>' : ' ', t,
+			data & 0xFF, (data >> 8) & 0xFF, (data >> 16) & 0xFF, data >> 24, sync);
+		for (int l = 0; l < 4; l++)
+			if ((sync & (1 << l)) && first_sync[l] < 0 && t >= 0)
+				first_sync[l] = t;
+	}
 
+	int lo = post, hi = -1;
+	printf("First sync per lane:");
+	for (int l = 0; l < 4; l++) {
+		if (first_sync[l] < 0) {
+			printf(" -");
+			continue;
+		}
+		printf(" %d", first_sync[l]);
+		if (first_sync[l] < lo)
+			lo = first_sync[l];
+		if (first_sync[l] > hi)
+			hi = first_sync[l];
 	}
+	if (hi >= 0)
+		printf(", skew %d byte clocks (aligner absorbs %d)", hi - lo, ALIGNER_DEPTH - 1);
+	printf("\n");
+}
+
+/*-----------------------------------------------------------------------*/
+/* Snapshot                                                              */
+/*-----------------------------------------------------------------------*/
+
+// In snapshot mode the sensor sits in standby and the D-PHY is powered down. The gateware powers the D-PHY up
+// on a trigger and down again after the first valid frame; the firmware follows with the sensor. The snapshot
+// interrupt only records the events: the I2C to the sensor is done by snap_service(), from the main loop and
+// from the console commands that loop until a key is pressed, never in the middle of another I2C transfer
+static bool snap_mode;
+static bool snap_sensor_awake;
+static volatile bool snap_wake_pending;
+static volatile bool snap_sleep_pending;
+
+static void snap_control(bool snap)
+{
+	snapshot_control_write(
+		(snap_mode << CSR_SNAPSHOT_CONTROL_ENABLE_OFFSET) |
+		(snap_mode << CSR_SNAPSHOT_CONTROL_HW_TRIGGER_OFFSET) |
+		(snap << CSR_SNAPSHOT_CONTROL_SNAP_OFFSET));
+}
+
+static void snap_report(void)
+{
+	unsigned cycles_per_us = CONFIG_CLOCK_FREQUENCY / 1000000;
+	printf("Snapshot: frame start after %u us, valid frame after %u us, %u frames skipped\n",
+		snapshot_latency_start_read() / cycles_per_us, snapshot_latency_frame_read() / cycles_per_us,
+		snapshot_skipped_read());
+}
+
+void snap_isr(void);
+void snap_isr(void)
+{
+	uint32_t pending = snapshot_ev_pending_read();
+	snapshot_ev_pending_write(pending);
+	if (pending & (1 << CSR_SNAPSHOT_EV_PENDING_WAKE_OFFSET))
+		snap_wake_pending = true;
+	if (pending & (1 << CSR_SNAPSHOT_EV_PENDING_SLEEP_OFFSET))
+		snap_sleep_pending = true;
+}
+
+static void snap_enter(void)
+{
+	snapshot_ev_pending_write(snapshot_ev_pending_read());
+	snapshot_ev_enable_write((1 << CSR_SNAPSHOT_EV_ENABLE_WAKE_OFFSET) | (1 << CSR_SNAPSHOT_EV_ENABLE_SLEEP_OFFSET));
+#ifdef CONFIG_CPU_HAS_INTERRUPT
+	irq_setmask(irq_getmask() | (1 << SNAPSHOT_INTERRUPT));
+#endif
+	// every line of a streamed frame must arrive for a snapshot to count
+	snapshot_lines_write(line_count_in_read());
+	camera_standby(true);
+	snap_sensor_awake = false;
+	snap_mode = true;
+	snap_control(false);
+}
+
+static void snap_exit(void)
+{
+	snap_mode = false;
+	snap_control(false);
+	camera_stream();
+	snap_sensor_awake = true;
+}
+
+// Wakes the sensor for a hardware triggered snapshot and puts it back to sleep after it
+static void snap_service(void)
+{
+	if (snap_wake_pending) {
+		snap_wake_pending = false;
+		if (snap_mode && !snap_sensor_awake) {
+			camera_stream();
+			snap_sensor_awake = true;
+		}
+	}
+	if (snap_sleep_pending) {
+		snap_sleep_pending = false;
+		if (snap_mode && snap_sensor_awake) {
+			camera_standby(true);
+			snap_sensor_awake = false;
+			if (snapshot_status_read() & (1 << CSR_SNAPSHOT_STATUS_DONE_OFFSET))
+				snap_report();
+		}
+	}
+}
+
+static void snap_cmd(char *str)
+{
+	char *token = get_token(&str);
+	if (strcmp(token, "on") == 0) {
+		snap_enter();
+		return;
+	} else if (strcmp(token, "off") == 0) {
+		snap_exit();
+		return;
+	}
+
+	if (!snap_mode)
+		snap_enter();
+	uint64_t start = prof_cycles();
+	// wakes the sensor here rather than in snap_service(), to time it
+	snap_sensor_awake = true;
+	snap_control(true);
+	camera_stream();
+	unsigned wake_us = (prof_cycles() - start) / (CONFIG_CLOCK_FREQUENCY / 1000000);
+	for (int ms = 0; ms < 2000; ms++) {
+		if (!(snapshot_status_read() & (1 << CSR_SNAPSHOT_STATUS_BUSY_OFFSET)))
+			break;
+		busy_wait(1);
+	}
+	camera_standby(true);
+	snap_sensor_awake = false;
+	snap_wake_pending = false;
+	snap_sleep_pending = false;
+	if (!(snapshot_status_read() & (1 << CSR_SNAPSHOT_STATUS_DONE_OFFSET))) {
+		printf("No valid frame received\n");
+		// clearing enable abandons the snapshot; re-enabling powers the D-PHY down again
+		snapshot_control_write(0);
+		snap_control(false);
+		return;
+	}
+	printf("Sensor wake took %u us\n", wake_us);
+	snap_report();
+}
+
+/*-----------------------------------------------------------------------*/
+/* HyperRAM cache                                                        */
+/*-----------------------------------------------------------------------*/
+
+#ifdef CSR_HR_CACHE_BASE
+
+// Scratch area for the copy benchmark, between the firmware and the compressed frame buffers
+#define CACHEBENCH_BASE (MAIN_RAM_BASE + 0x100000)
+#define CACHEBENCH_SIZE 0x8000
+
+static void cache_set(bool enable, bool prefetch)
+{
+	uint32_t ctrl = (enable << CSR_HR_CACHE_CONTROL_ENABLE_OFFSET) |
+		(prefetch << CSR_HR_CACHE_CONTROL_PREFETCH_OFFSET);
+	hr_cache_control_write(ctrl | (1 << CSR_HR_CACHE_CONTROL_FLUSH_OFFSET) | (1 << CSR_HR_CACHE_CONTROL_CLEAR_OFFSET));
+	flush_cpu_dcache();
+	flush_cpu_icache();
+}
+
+static void cache_stats(void)
+{
+	unsigned hits = hr_cache_hits_read(), misses = hr_cache_misses_read();
+	printf("hits %u misses %u (%u%%), prefetched lines %u, used %u\n", hits, misses,
+		hits + misses ? 100 * hits / (hits + misses) : 0, hr_cache_prefetches_read(), hr_cache_prefetch_hits_read());
+}
+
+static void cachebench_cmd(void)
+{
+	static const struct {
+		const char *name;
+		bool enable, prefetch;
+	} modes[] = {
+		{"off",      false, false},
+		{"cache",    true,  false},
+		{"prefetch", true,  true},
+	};
+	uint32_t restore = hr_cache_control_read();
+
+	for (unsigned i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+		uint64_t start;
+		unsigned t_init, t_copy;
+
+		printf("%s:\n", modes[i].name);
+		cache_set(modes[i].enable, modes[i].prefetch);
+		start = prof_cycles();
+		camera_init();
+		t_init = prof_cycles() - start;
+
+		flush_cpu_dcache();
+		start = prof_cycles();
+		memcpy((void *)(CACHEBENCH_BASE + CACHEBENCH_SIZE), (const void *)CACHEBENCH_BASE, CACHEBENCH_SIZE);
+		flush_cpu_dcache();
+		t_copy = prof_cycles() - start;
+
+		printf("  camera_init %u us, memcpy %uKB %u cycles (%u KB/s)\n",
+			t_init / (CONFIG_CLOCK_FREQUENCY / 1000000), CACHEBENCH_SIZE / 1024, t_copy,
+			(unsigned)((uint64_t)CACHEBENCH_SIZE * CONFIG_CLOCK_FREQUENCY / 1024 / t_copy));
+		printf("  ");
+		cache_stats();
+	}
+	hr_cache_control_write(restore);
+}
+
+static void cache_cmd(char *str)
+{
+	char *token = get_token(&str);
+
+	if (strcmp(token, "on") == 0)
+		cache_set(true, true);
+	else if (strcmp(token, "noprefetch") == 0)
+		cache_set(true, false);
+	else if (strcmp(token, "off") == 0)
+		cache_set(false, false);
+	else if (strcmp(token, "bench") == 0) {
+		cachebench_cmd();
+		return;
+	}
+	printf("HyperRAM cache %s%s: ", (hr_cache_control_read() >> CSR_HR_CACHE_CONTROL_ENABLE_OFFSET) & 1 ? "on" : "off",
+		(hr_cache_control_read() >> CSR_HR_CACHE_CONTROL_PREFETCH_OFFSET) & 1 ? ", prefetch" : "");
+	cache_stats();
+}
+
+#endif
+
+/*-----------------------------------------------------------------------*/
+/* Compression                                                           */
+/*-----------------------------------------------------------------------*/
+
+// Compressed frames go in the upper 6MB of main_ram, clear of the firmware
+#define COMPRESS_TABLE_BASE (MAIN_RAM_BASE + 0x200000)
+#define COMPRESS_TABLE_SIZE 0x4000
+#define COMPRESS_DATA_BASE  (COMPRESS_TABLE_BASE + COMPRESS_TABLE_SIZE)
+#define COMPRESS_DATA_SIZE  (MAIN_RAM_SIZE - 0x200000 - COMPRESS_TABLE_SIZE)
+
+static void compress_dump(void)
+{
+	const uint32_t *table = (const uint32_t *)COMPRESS_TABLE_BASE;
+	const uint32_t *data = (const uint32_t *)COMPRESS_DATA_BASE;
+	unsigned lines = compressor_lines_read();
+	unsigned words = compressor_out_bytes_read() / 4;
+
+	flush_cpu_dcache();
+	printf("lines %u words %u\n", lines, words);
+	for (unsigned i = 0; i < lines; i++)
+		printf("%s%08x%s", (i % 8) == 0 ? "T " : " ", table[i], (i % 8) == 7 ? "\n" : "");
+	printf("\n");
+	for (unsigned i = 0; i < words; i++)
+		printf("%s%08x%s", (i % 8) == 0 ? "D " : " ", data[i], (i % 8) == 7 ? "\n" : "");
+	printf("\n");
+}
+
+static void compress_cmd(char *str)
+{
+	char *token = get_token(&str);
+	if (strcmp(token, "dump") == 0) {
+		compress_dump();
+		return;
+	}
+
+	compressor_table_base_write(COMPRESS_TABLE_BASE);
+	compressor_data_base_write(COMPRESS_DATA_BASE);
+	compressor_data_size_write(COMPRESS_DATA_SIZE);
+	compressor_control_write(1 << CSR_COMPRESSOR_CONTROL_ARM_OFFSET);
+	for (int ms = 0; ms < 2000; ms++) {
+		if (compressor_status_read() & (1 << CSR_COMPRESSOR_STATUS_DONE_OFFSET))
+			break;
+		busy_wait(1);
+	}
+	uint32_t status = compressor_status_read();
+	if (!(status & (1 << CSR_COMPRESSOR_STATUS_DONE_OFFSET))) {
+		printf("No frame received\n");
+		return;
+	}
+	if (status & (1 << CSR_COMPRESSOR_STATUS_OVERFLOW_OFFSET))
+		printf("Overflow: main_ram could not keep up, frame truncated\n");
+
+	unsigned lines = compressor_lines_read();
+	unsigned bad = compressor_bad_lines_read();
+	uint32_t in = compressor_in_bytes_read();
+	uint32_t out = compressor_out_bytes_read();
+	uint32_t bad_out = compressor_bad_bytes_read();
+	unsigned us = compressor_cycles_read() / (CONFIG_CLOCK_FREQUENCY / 1000000);
+	// the ratio is over the complete lines only: in_bytes has nothing for the cut short ones
+	uint32_t good_out = out - bad_out;
+	unsigned ratio = good_out ? (unsigned)(((uint64_t)in * 100) / good_out) : 0;
+	// RAW10 is 10 bits per pixel, so bits/pixel = 10 * out / in
+	unsigned bpp = in ? (unsigned)(((uint64_t)good_out * 1000) / in) : 0;
+	printf("%u/%u lines stored, %u cut short upstream (%u bytes written for them)\n", lines, CAM_HEIGHT, bad,
+		bad_out);
+	printf("%u -> %u bytes, ratio %u.%02u, %u.%02u bits/pixel\n", in, good_out,
+		ratio / 100, ratio % 100, bpp / 100, bpp % 100);
+	if (us)
+		printf("%u us: payload %u KB/s, written %u KB/s\n", us,
+			(unsigned)(((uint64_t)in * 1000) / us), (unsigned)(((uint64_t)out * 1000) / us));
 }
 
 static void console_service(void)
@@ -192,30 +1146,61 @@ static void console_service(void)
 		camera_init();
 	else if(strcmp(token, "freq") == 0)
 		read_freq_cmd();
-	else if(strcmp(token, "data") == 0)
-		read_data_cmd();
+	else if(strcmp(token, "trace") == 0)
+		trace_cmd(str);
 	else if(strcmp(token, "packet") == 0)
 		read_packet_cmd();
+	else if(strcmp(token, "csi") == 0)
+		read_csi_cmd();
 	else if(strcmp(token, "image") == 0)
 		read_image_cmd();
 	else if(strcmp(token, "lcd") == 0)
 		write_lcd_cmd();
+	else if(strcmp(token, "imgbench") == 0)
+		imgbench_cmd();
+	else if(strcmp(token, "pyramid") == 0)
+		pyramid_cmd();
+	else if(strcmp(token, "changes") == 0)
+		changes_cmd(str);
+	else if(strcmp(token, "pixbench") == 0)
+		pixbench_cmd();
+	else if(strcmp(token, "accum") == 0)
+		accum_cmd(str);
+	else if(strcmp(token, "roi") == 0)
+		roi_cmd(str);
+	else if(strcmp(token, "prof") == 0)
+		prof_report();
 	else if(strcmp(token, "lines") == 0)
 		read_line_count_cmd();
+	else if(strcmp(token, "linktest") == 0)
+		linktest_cmd(str);
+	else if(strcmp(token, "dphy") == 0)
+		dphy_cmd(str);
+	else if(strcmp(token, "snap") == 0)
+		snap_cmd(str);
+	else if(strcmp(token, "compress") == 0)
+		compress_cmd(str);
+#ifdef CSR_HR_CACHE_BASE
+	else if(strcmp(token, "cache") == 0)
+		cache_cmd(str);
+#endif
 	prompt();
 }
 
 int main(void)
 {
+	uint64_t main_start = prof_cycles();
 #ifdef CONFIG_CPU_HAS_INTERRUPT
 	irq_setmask(0);
 	irq_setie(1);
 #endif
 	uart_init();
 
+	changes_init();
 	lcd_init();
 
 	camera_init();
+	printf("Init %u ms\n", (unsigned)((prof_cycles() - main_start) / (CONFIG_CLOCK_FREQUENCY / 1000)));
 
 	help();
 	prompt();
@@ -223,6 +1208,7 @@ int main(void)
 
 	while(1) {
 		console_service();
+		snap_service();
 	}
 
 	return 0;
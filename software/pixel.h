@@ -0,0 +1,63 @@
+#ifndef PIXEL_H
+#define PIXEL_H
+
+#include <stdint.h>
+
+#include <generated/soc.h>
+
+// Packed Bayer quad as stored by the preview pyramid: R, Gr, Gb, B from LSB to MSB
+#define QUAD_R(q)  ((q) & 0xFF)
+#define QUAD_GR(q) (((q) >> 8) & 0xFF)
+#define QUAD_GB(q) (((q) >> 16) & 0xFF)
+#define QUAD_B(q)  (((q) >> 24) & 0xFF)
+
+// Plain C versions, always available so the custom instructions can be benchmarked against them
+static inline uint32_t pix_rgb565_sw(uint32_t q)
+{
+	return ((QUAD_R(q) >> 3) << 11) | ((QUAD_GR(q) >> 2) << 5) | (QUAD_B(q) >> 3);
+}
+
+static inline uint32_t pix_extract_sw(uint32_t q, uint32_t lane)
+{
+	return (q >> (8 * (lane & 3))) & 0xFF;
+}
+
+static inline uint32_t pix_addsat_sw(uint32_t a, uint32_t b)
+{
+	uint32_t r = 0;
+	for (int i = 0; i < 32; i += 8) {
+		uint32_t s = ((a >> i) & 0xFF) + ((b >> i) & 0xFF);
+		r |= (s > 0xFF ? 0xFF : s) << i;
+	}
+	return r;
+}
+
+static inline uint32_t pix_avg_sw(uint32_t a, uint32_t b)
+{
+	// per byte (a + b + 1) >> 1 without carries between lanes
+	return (a | b) - (((a ^ b) >> 1) & 0x7F7F7F7F);
+}
+
+#ifdef PIXEL_CFU
+
+// Custom-0 R-type instructions of the pixel CFU (pixel_cfu.py), selected by funct3
+#define PIX_CFU_OP(funct3, a, b) ({ \
+	uint32_t _r; \
+	asm volatile(".insn r 0x0B, " #funct3 ", 0, %0, %1, %2" : "=r"(_r) : "r"(a), "r"(b)); \
+	_r; })
+
+static inline uint32_t pix_rgb565(uint32_t q)              { return PIX_CFU_OP(0, q, 0); }
+static inline uint32_t pix_extract(uint32_t q, uint32_t l) { return PIX_CFU_OP(1, q, l); }
+static inline uint32_t pix_addsat(uint32_t a, uint32_t b)  { return PIX_CFU_OP(2, a, b); }
+static inline uint32_t pix_avg(uint32_t a, uint32_t b)     { return PIX_CFU_OP(3, a, b); }
+
+#else
+
+#define pix_rgb565  pix_rgb565_sw
+#define pix_extract pix_extract_sw
+#define pix_addsat  pix_addsat_sw
+#define pix_avg     pix_avg_sw
+
+#endif
+
+#endif
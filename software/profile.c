@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <generated/soc.h>
+
+#include "profile.h"
+
+#ifdef PROFILE
+
+struct prof_entry {
+	uint64_t start;
+	uint64_t total;
+	uint32_t calls;
+};
+
+static const char *const prof_names[PROF_COUNT] = {
+	[PROF_RUN_INIT_SEQUENCE] = "run_init_sequence",
+	[PROF_LCD_INIT]          = "lcd_init",
+	[PROF_LCD_FRAME]         = "write_lcd_cmd frame",
+	[PROF_READ_IMAGE]        = "read_image_cmd",
+};
+
+static struct prof_entry prof_table[PROF_COUNT];
+
+void prof_begin(enum prof_id id)
+{
+	prof_table[id].start = prof_cycles();
+}
+
+void prof_end(enum prof_id id)
+{
+	prof_table[id].total += prof_cycles() - prof_table[id].start;
+	prof_table[id].calls++;
+}
+
+void prof_report(void)
+{
+	printf("%-20s %8s %12s %12s\n", "section", "calls", "total us", "avg cycles");
+	for (int i = 0; i < PROF_COUNT; i++) {
+		struct prof_entry *e = &prof_table[i];
+		unsigned us = (unsigned)(e->total / (CONFIG_CLOCK_FREQUENCY / 1000000));
+		unsigned avg = e->calls ? (unsigned)(e->total / e->calls) : 0;
+		printf("%-20s %8u %12u %12u\n", prof_names[i], (unsigned)e->calls, us, avg);
+	}
+	memset(prof_table, 0, sizeof(prof_table));
+}
+
+#else
+
+void prof_report(void)
+{
+	printf("Profiling disabled (build with PROFILE=1)\n");
+}
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+
+#include <generated/csr.h>
+
+// Free running sys clock cycle count (timer0 uptime, unaffected by busy_wait)
+static inline uint64_t prof_cycles(void)
+{
+	timer0_uptime_latch_write(1);
+	return timer0_uptime_cycles_read();
+}
+
+enum prof_id {
+	PROF_RUN_INIT_SEQUENCE,
+	PROF_LCD_INIT,
+	PROF_LCD_FRAME,
+	PROF_READ_IMAGE,
+	PROF_COUNT
+};
+
+// Scoped markers; build with PROFILE=0 and they compile to nothing
+#ifdef PROFILE
+void prof_begin(enum prof_id id);
+void prof_end(enum prof_id id);
+#define PROF_BEGIN(id) prof_begin(id)
+#define PROF_END(id) prof_end(id)
+#else
+#define PROF_BEGIN(id) do { } while (0)
+#define PROF_END(id) do { } while (0)
+#endif
+
+// Print the table of accumulated times and call counts, then reset it
+void prof_report(void);
+
+#endif